@@ -30,11 +30,43 @@
  * For more information, please refer to <http://unlicense.org/>
  */
 
+/* For open_memstream and shm_open, and for syscall and the io_uring ring setup on Linux */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#endif
+
 #include "stdlib.h"
 #include "stdio.h"
 #include "stddef.h"
 #include "stdint.h"
 #include "string.h"
+#include "stdarg.h"
+#include "limits.h"
+#include "time.h"
+#include "errno.h"
+#ifdef _WIN32
+#include "io.h"
+#include "fcntl.h"
+#else
+#include "pthread.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "sys/stat.h"
+#include "sys/mman.h"
+#endif
+/* io_uring is used through its system calls, so liburing isn't needed */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include("linux/io_uring.h")
+#define HAVE_IO_URING
+#include "linux/io_uring.h"
+#include "sys/syscall.h"
+/* Older headers don't have everything that's used */
+#ifndef IORING_FEAT_FAST_POLL
+#undef HAVE_IO_URING
+#endif
+#endif
+#endif
 #include "math.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
@@ -46,6 +78,10 @@ const uint32_t PackId      = 1262698832;  /* P A C K */
 const uint32_t SizeId      = 1163544915;  /* S I Z E */
 const uint32_t VoxelId     = 1230657880;  /* X Y Z I */
 const uint32_t PaletteId   = 1094862674;  /* R G B A */
+const uint32_t TransformId = 1314018414;  /* n T R N */
+const uint32_t GroupId     = 1347569518;  /* n G R P */
+const uint32_t ShapeId     = 1346917230;  /* n S H P */
+const uint32_t LayerId     = 1381581132;  /* L A Y R */
 
 /* MagicaVoxel's default color palette */
 unsigned int defaultPalette[256] = {
@@ -129,8 +165,22 @@ typedef struct {
     const VoxelChunk **voxelChunks;
     /* A pointer to the used palette */
     const uint32_t *palette;
+    /* Chunks that were made by vox2png instead of read from the file,
+       the size and voxel chunks point into this when it isn't NULL */
+    void *ownedChunks;
 } ParsedVox;
 
+/* Where progress messages go, stderr when the output is written to stdout */
+static FILE *infoOutput = NULL;
+
+/* Prints a progress message */
+void printInfo(const char *format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(infoOutput ? infoOutput : stdout, format, arguments);
+    va_end(arguments);
+}
+
 /* Parses a .vox file and puts the relevant data in a ParsedVox struct */
 ParsedVox parseVox(size_t len, const char *buf) {
     /* Check the file header before we begin parsing */
@@ -143,11 +193,15 @@ ParsedVox parseVox(size_t len, const char *buf) {
         fputs("Warning: Vox file is for a newer MagicaVoxel version than vox2png supports\n", stderr);
     }
 
+    /* Files without a PACK chunk can still have many models, newer
+       MagicaVoxel versions place those with a scene graph */
     uint32_t numModels = 1;
+    int foundPack = 0;
     const SizeChunk **sizeChunks = NULL;
-    int currentSize = 0;
+    uint32_t currentSize = 0;
     const VoxelChunk **voxelChunks = NULL;
-    int currentVoxel = 0;
+    uint32_t currentVoxel = 0;
+    uint32_t capacity = 0;
     const uint32_t *palette = (uint32_t *) &defaultPalette[0];
 
     /* Iterate the .vox file chunk by chunk */
@@ -160,23 +214,22 @@ ParsedVox parseVox(size_t len, const char *buf) {
             /* Store the amount of models */
             const PackChunk *pack = (PackChunk *) chunk;
             numModels = pack->numModels;
-            printf("Found %i models\n", numModels);
+            foundPack = 1;
+            printInfo("Found %i models\n", numModels);
         }
         else if (id == SizeId) {
-            /* Create an array of SizeChunks if we don't have one already */
-            if (sizeChunks == NULL) {
-                sizeChunks = malloc(sizeof(SizeChunk *) * numModels);
+            /* Grow the arrays of chunks when there are more models than we have room for */
+            if (currentSize == capacity) {
+                capacity = capacity ? capacity * 2 : numModels ? numModels : 1;
+                sizeChunks = realloc(sizeChunks, sizeof(SizeChunk *) * capacity);
+                voxelChunks = realloc(voxelChunks, sizeof(VoxelChunk *) * capacity);
             }
             /* Store the SizeChunk in the array */
             const SizeChunk *size = (SizeChunk *) chunk;
             sizeChunks[currentSize] = size;
             currentSize++;
         }
-        else if (id == VoxelId) {
-            /* Create an array of VoxelChunks if we don't have one already */
-            if (voxelChunks == NULL) {
-                voxelChunks = malloc(sizeof(VoxelChunk *) * numModels);
-            }
+        else if (id == VoxelId && currentVoxel < currentSize) {
             /* Store the VoxelChunk in the array */
             const VoxelChunk *voxels = (VoxelChunk *) chunk;
             voxelChunks[currentVoxel] = voxels;
@@ -186,7 +239,7 @@ ParsedVox parseVox(size_t len, const char *buf) {
             /* Store the palette */
             const PaletteChunk *pal = (PaletteChunk *) chunk;
             palette = &pal->colors[0];
-            puts("Found a palette");
+            printInfo("Found a palette\n");
         }
 
         /* Step to the next chunk */
@@ -195,8 +248,18 @@ ParsedVox parseVox(size_t len, const char *buf) {
         if ((char *) chunk >= buf + len) break;
     }
 
+    if (!foundPack && currentSize > 1) {
+        printInfo("Found %u models\n", currentSize);
+    }
+    if (!foundPack || currentVoxel < numModels) {
+        numModels = currentVoxel;
+    }
+    if (numModels == 0) {
+        fputs("Error: Vox file doesn't contain any models\n", stderr);
+        exit(-1);
+    }
     return (ParsedVox) {
-        numModels, sizeChunks, voxelChunks, palette
+        numModels, sizeChunks, voxelChunks, palette, NULL
     };
 }
 
@@ -204,263 +267,5064 @@ ParsedVox parseVox(size_t len, const char *buf) {
 void freeParsedVox(ParsedVox parsedVox) {
     free(parsedVox.sizeChunks);
     free(parsedVox.voxelChunks);
+    free(parsedVox.ownedChunks);
 }
 
-/* Allocates a buffer and reads the contents of the file into it */
-void readFile(const char *path, size_t *len, char **buf) {
-    FILE *handle = fopen(path, "rb");
-    if (!handle) {
-        fputs("Error: Could not read file, are you sure it exists?\n", stderr);
-        exit(-1);
+/* Returns a ParsedVox with only model i of vox in it, which shares the
+   chunks of vox and must not be freed */
+ParsedVox selectModel(ParsedVox vox, uint32_t i) {
+    ParsedVox model = vox;
+    model.numModels = 1;
+    model.sizeChunks = vox.sizeChunks + i;
+    model.voxelChunks = vox.voxelChunks + i;
+    model.ownedChunks = NULL;
+    return model;
+}
+
+/* Where the trimmed models are in the original models */
+typedef struct {
+    /* The position of the trimmed box in the original models */
+    uint32_t x, y, z;
+    /* The number of layers that were kept */
+    uint32_t numLayers;
+    /* The original Z of every kept layer */
+    uint32_t layerZ[256];
+} TrimInfo;
+
+/* Crops the models to the box that contains all of their voxels, and drops
+   the Z layers that are empty in every model. All models get the same box
+   so that animation keyframes stay aligned. Returns a new ParsedVox that
+   owns its chunks, the original one stays valid. Models without any voxels
+   aren't trimmed, then vox itself is returned */
+ParsedVox trimVox(ParsedVox vox, TrimInfo *info) {
+    uint32_t minX = 255, minY = 255, minZ = 255;
+    uint32_t maxX = 0, maxY = 0, maxZ = 0;
+    uint8_t usedLayers[256] = { 0 };
+    uint64_t totalVoxels = 0;
+
+    /* Find the occupied box and layers */
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        const VoxelChunk *voxelChunk = vox.voxelChunks[i];
+        const Voxel *voxels = getVoxels(voxelChunk);
+        for (uint32_t j = 0; j < voxelChunk->numVoxels; ++j) {
+            Voxel v = voxels[j];
+            if (v.x < minX) minX = v.x;
+            if (v.y < minY) minY = v.y;
+            if (v.x > maxX) maxX = v.x;
+            if (v.y > maxY) maxY = v.y;
+            if (v.z < minZ) minZ = v.z;
+            if (v.z > maxZ) maxZ = v.z;
+            usedLayers[v.z] = 1;
+        }
+        totalVoxels += voxelChunk->numVoxels;
+    }
+
+    /* Map the used layers to consecutive layers */
+    uint8_t layerMap[256];
+    info->numLayers = 0;
+    for (uint32_t z = 0; z < 256; ++z) {
+        if (usedLayers[z]) {
+            layerMap[z] = (uint8_t) info->numLayers;
+            info->layerZ[info->numLayers++] = z;
+        }
+    }
+    if (info->numLayers == 0) {
+        fputs("Warning: The models don't contain any voxels, not trimming\n", stderr);
+        info->x = info->y = info->z = 0;
+        for (uint32_t z = 0; z < 256; ++z) info->layerZ[z] = z;
+        info->numLayers = vox.sizeChunks[0]->z;
+        return vox;
     }
-    /* Get the length of the file */
-    fseek(handle, 0, SEEK_END);
-    *len = ftell(handle);
-    fseek(handle, 0, SEEK_SET);
-    /* Allocate a big enough buffer to fit the file */
-    *buf = malloc(*len + 1);
-    /* Read the file into the buffer and close it */
-    fread(*buf, *len, 1, handle);
-    fclose(handle);
+    info->x = minX;
+    info->y = minY;
+    info->z = minZ;
+
+    /* Make the trimmed chunks, all size chunks first and then the voxel chunks */
+    size_t sizesLength = sizeof(SizeChunk) * vox.numModels;
+    char *owned = malloc(sizesLength + sizeof(VoxelChunk) * vox.numModels + sizeof(Voxel) * totalVoxels);
+    SizeChunk *sizes = (SizeChunk *) owned;
+    char *nextVoxelChunk = owned + sizesLength;
+
+    ParsedVox trimmed = vox;
+    trimmed.sizeChunks = malloc(sizeof(SizeChunk *) * vox.numModels);
+    trimmed.voxelChunks = malloc(sizeof(VoxelChunk *) * vox.numModels);
+    trimmed.ownedChunks = owned;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        sizes[i] = *vox.sizeChunks[i];
+        sizes[i].x = maxX - minX + 1;
+        sizes[i].y = maxY - minY + 1;
+        sizes[i].z = info->numLayers;
+        trimmed.sizeChunks[i] = &sizes[i];
+
+        const VoxelChunk *voxelChunk = vox.voxelChunks[i];
+        const Voxel *voxels = getVoxels(voxelChunk);
+        VoxelChunk *newChunk = (VoxelChunk *) nextVoxelChunk;
+        Voxel *newVoxels = (Voxel *) (newChunk + 1);
+        *newChunk = *voxelChunk;
+        for (uint32_t j = 0; j < voxelChunk->numVoxels; ++j) {
+            Voxel v = voxels[j];
+            newVoxels[j] = (Voxel) {
+                v.x - minX, v.y - minY, layerMap[v.z], v.colorIndex
+            };
+        }
+        trimmed.voxelChunks[i] = newChunk;
+        nextVoxelChunk = (char *) (newVoxels + voxelChunk->numVoxels);
+    }
+
+    return trimmed;
 }
 
-void printUsage(void) {
-    puts("Usage: vox2png INPUT.vox OUTPUT.png [PACKING-MODE]");
-    puts("    Where INPUT.vox is the input file and OUTPUT.png is the output file name");
-    puts("      * You should leave the .png away in OUTPUT when you're using either multifile or gamemaker");
-    puts("    PACKING-MODE can be one of:");
-    puts("      * animated puts depth on the X axis and keyframes on the Y axis");
-    puts("        This is the only mode that supports animation keyframes");
-    puts("      * horizontal puts all cells next to each other on the X axis of the sprite sheet.");
-    puts("      * vertical does the same thing but on the Y axis.");
-    puts("      * square goes left->right and top->bottom, like Minecraft's terrain.png.");
-    puts("      * multifile makes a different file for each cell, don't put .png after the output file in this mode.");
-    puts("      * gamemaker is the same as horizontal, but it adds _stripN after the filename,");
-    puts("        which makes it easier to import in GameMaker. Don't put .png after the output file in this mode.");
-    puts("    The default PACKING-MODE is animated");
-    puts("");
-    puts("=== IMPORTANT ===");
-    puts("If you're having trouble with the colors being off, change a color in the vox files color palette.'");
-    puts("This forces MagicaVoxel to save the palette data ensuring that you'll get the right colors.");
+/* Returns the smallest power of two that is at least value */
+static uint32_t nextPowerOfTwo(uint32_t value) {
+    uint32_t result = 1;
+    while (result < value) result *= 2;
+    return result;
 }
 
-/* Describes how the sprites should be packed into the sprite sheet */
-typedef enum {
-    /* Animation keyframes under eachother on the Y axis and
-       depth next to eachother on the X axis */
-    PM_ANIMATED = 0,
-    /* Next to each other on the X axis */
-    PM_HORIZONTAL,
-    /* Next to each other on the Y axis */
-    PM_VERTICAL,
-    /* Left to right and top to bottom */
-    PM_SQUARE,
-    /* One file per sprite */
-    PM_MULTIFILE,
-    /* Like horizontal, but with _stripXX appended to the filename,
-       where XX is the amount of sprites */
-    PM_GAMEMAKER,
+/* Returns the largest power of two that is at most value */
+static uint32_t previousPowerOfTwo(uint32_t value) {
+    uint32_t result = 1;
+    while (result * 2 <= value) result *= 2;
+    return result;
+}
 
-    PM_SIZE,
-} PackingMode;
+/* Rounds the size of a cell up to a multiple of align, or to a power of
+   two when align is 0 */
+static uint32_t alignCellSize(uint32_t size, uint32_t align) {
+    if (align == 0) return nextPowerOfTwo(size);
+    return (size + align - 1) / align * align;
+}
 
-/* The strings used to get the PackingMode from the CLI arguments */
-const char *packingModeStrings[PM_SIZE] = {
-    "animated",
-    "horizontal",
-    "vertical",
-    "square",
-    "multifile",
-    "gamemaker",
-};
+/* Grows the X and Y size of every model with alignCellSize, which pads
+   every cell of a sheet with transparent pixels. Returns a new ParsedVox
+   that owns its chunks, the original one stays valid */
+ParsedVox padVox(ParsedVox vox, uint32_t align) {
+    size_t sizesLength = sizeof(SizeChunk) * vox.numModels;
+    size_t length = sizesLength;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        length += sizeof(VoxelChunk) + sizeof(Voxel) * vox.voxelChunks[i]->numVoxels;
+    }
+    char *owned = malloc(length);
+    SizeChunk *sizes = (SizeChunk *) owned;
+    char *nextVoxelChunk = owned + sizesLength;
 
-/* The parsed command line arguments */
-typedef struct {
-    const char *inFile;
-    const char *outFile;
-    PackingMode mode;
-} CLArgs;
+    ParsedVox padded = vox;
+    padded.sizeChunks = malloc(sizeof(SizeChunk *) * vox.numModels);
+    padded.voxelChunks = malloc(sizeof(VoxelChunk *) * vox.numModels);
+    padded.ownedChunks = owned;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        sizes[i] = *vox.sizeChunks[i];
+        sizes[i].x = alignCellSize(sizes[i].x, align);
+        sizes[i].y = alignCellSize(sizes[i].y, align);
+        padded.sizeChunks[i] = &sizes[i];
 
-/* Parses the command line arguments */
-CLArgs parseArgs(int argc, char **argv) {
-    if (argc < 3 || argc > 4) {
-        fputs("Error: Wrong number of arguments\n", stderr);
-        printUsage();
-        exit(-1);
+        size_t chunkLength = sizeof(VoxelChunk) + sizeof(Voxel) * vox.voxelChunks[i]->numVoxels;
+        memcpy(nextVoxelChunk, vox.voxelChunks[i], chunkLength);
+        padded.voxelChunks[i] = (const VoxelChunk *) nextVoxelChunk;
+        nextVoxelChunk += chunkLength;
     }
-    if (argc >= 2 &&
-            (strcmp(argv[1], "--help") == 0 ||
-             strcmp(argv[1], "-h") == 0)) {
-        printUsage();
-        exit(0);
+    return padded;
+}
+
+/* Sums of a width x height grid of bytes, where sums[y * (width + 1) + x]
+   is the sum of the bytes left of and above (x, y) */
+static void makeSummedArea(const uint8_t *grid, uint32_t width, uint32_t height, uint32_t *sums) {
+    memset(sums, 0, sizeof(uint32_t) * (width + 1));
+    for (uint32_t y = 0; y < height; ++y) {
+        uint32_t *row = sums + (y + 1) * (width + 1);
+        const uint32_t *above = row - (width + 1);
+        uint32_t rowSum = 0;
+        row[0] = 0;
+        for (uint32_t x = 0; x < width; ++x) {
+            rowSum += grid[y * width + x];
+            row[x + 1] = above[x + 1] + rowSum;
+        }
+    }
+}
+
+/* Finds the voxels of a model that can't be seen when the layers are
+   stacked on top of each other with an offset of at most radius pixels
+   between two layers, in any direction. Those are the voxels where the
+   square of radius voxels around them in the layer above is completely
+   filled. Sets hidden[i] for every hidden voxel i and returns how many
+   there are */
+static uint32_t findHiddenVoxels(const SizeChunk *size, const VoxelChunk *voxelChunk,
+                                 uint32_t radius, uint8_t *hidden) {
+    size_t layerSize = (size_t) size->x * size->y;
+    uint8_t *filled = calloc(layerSize * size->z, 1);
+    const Voxel *voxels = getVoxels(voxelChunk);
+    for (uint32_t i = 0; i < voxelChunk->numVoxels; ++i) {
+        Voxel v = voxels[i];
+        filled[v.z * layerSize + v.y * size->x + v.x] = 1;
     }
 
-    CLArgs args;
-    args.inFile = argv[1];
-    args.outFile = argv[2];
-    args.mode = PM_ANIMATED;
-    if (argc == 4) {
-        for (int i = 0; i < PM_SIZE; ++i) {
-            if (strcmp(argv[3], packingModeStrings[i]) == 0) {
-                args.mode = i;
-                return args;
+    /* A voxel is covered by the layer above when the summed area of the
+       square around it is its full area. The squares that stick out of
+       the model never are */
+    uint8_t *covered = calloc(layerSize * size->z, 1);
+    uint32_t *sums = malloc(sizeof(uint32_t) * (size->x + 1) * (size->y + 1));
+    uint32_t side = 2 * radius + 1;
+    for (uint32_t z = 0; z + 1 < size->z; ++z) {
+        makeSummedArea(filled + (z + 1) * layerSize, size->x, size->y, sums);
+        for (uint32_t y = radius; y + radius < size->y; ++y) {
+            const uint32_t *top = sums + (y - radius) * (size->x + 1);
+            const uint32_t *bottom = sums + (y + radius + 1) * (size->x + 1);
+            for (uint32_t x = radius; x + radius < size->x; ++x) {
+                uint32_t area = bottom[x + radius + 1] - bottom[x - radius] - top[x + radius + 1] + top[x - radius];
+                covered[z * layerSize + y * size->x + x] = area == side * side;
             }
         }
-        fputs("Error: Unknown packing mode\n", stderr);
-        exit(-1);
     }
-    return args;
+
+    uint32_t numHidden = 0;
+    for (uint32_t i = 0; i < voxelChunk->numVoxels; ++i) {
+        Voxel v = voxels[i];
+        hidden[i] = covered[v.z * layerSize + v.y * size->x + v.x];
+        numHidden += hidden[i];
+    }
+    free(sums);
+    free(covered);
+    free(filled);
+    return numHidden;
 }
 
-/* An RGBA image */
+/* Removes the voxels that are hidden by the layers above them when those
+   are drawn with an offset of at most radius pixels, see findHiddenVoxels.
+   Stores the number of removed voxels in numCulled. Returns a new
+   ParsedVox that owns its chunks, the original one stays valid */
+ParsedVox cullVox(ParsedVox vox, uint32_t radius, uint64_t *numCulled) {
+    /* Find the hidden voxels of every model in parallel */
+    uint8_t **hidden = malloc(sizeof(uint8_t *) * vox.numModels);
+    uint32_t *numHidden = malloc(sizeof(uint32_t) * vox.numModels);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) vox.numModels; ++i) {
+        hidden[i] = malloc(vox.voxelChunks[i]->numVoxels + 1);
+        numHidden[i] = findHiddenVoxels(vox.sizeChunks[i], vox.voxelChunks[i], radius, hidden[i]);
+    }
+
+    /* Make the culled chunks, all size chunks first and then the voxel chunks */
+    size_t sizesLength = sizeof(SizeChunk) * vox.numModels;
+    size_t length = sizesLength;
+    *numCulled = 0;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        uint32_t numKept = vox.voxelChunks[i]->numVoxels - numHidden[i];
+        length += sizeof(VoxelChunk) + sizeof(Voxel) * numKept;
+        *numCulled += numHidden[i];
+    }
+    char *owned = malloc(length);
+    SizeChunk *sizes = (SizeChunk *) owned;
+    char *nextVoxelChunk = owned + sizesLength;
+
+    ParsedVox culled = vox;
+    culled.sizeChunks = malloc(sizeof(SizeChunk *) * vox.numModels);
+    culled.voxelChunks = malloc(sizeof(VoxelChunk *) * vox.numModels);
+    culled.ownedChunks = owned;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        sizes[i] = *vox.sizeChunks[i];
+        culled.sizeChunks[i] = &sizes[i];
+
+        const VoxelChunk *voxelChunk = vox.voxelChunks[i];
+        const Voxel *voxels = getVoxels(voxelChunk);
+        VoxelChunk *newChunk = (VoxelChunk *) nextVoxelChunk;
+        Voxel *newVoxels = (Voxel *) (newChunk + 1);
+        *newChunk = *voxelChunk;
+        newChunk->numVoxels = 0;
+        for (uint32_t j = 0; j < voxelChunk->numVoxels; ++j) {
+            if (!hidden[i][j]) newVoxels[newChunk->numVoxels++] = voxels[j];
+        }
+        newChunk->header.sizeContent = sizeof(uint32_t) + sizeof(Voxel) * newChunk->numVoxels;
+        culled.voxelChunks[i] = newChunk;
+        nextVoxelChunk = (char *) (newVoxels + newChunk->numVoxels);
+        free(hidden[i]);
+    }
+
+    free(hidden);
+    free(numHidden);
+    return culled;
+}
+
+/* Reads the contents of a chunk, anything read past the end of the
+   chunk is 0 or empty */
 typedef struct {
-    uint32_t width, height;
-    uint32_t *rgba;
-} Image;
+    const char *position, *end;
+} ChunkReader;
 
-/* Frees the image data */
-void freeImage(Image img) {
-    free(img.rgba);
+/* Makes a ChunkReader for the contents of a chunk */
+static ChunkReader makeChunkReader(const ChunkHeader *chunk) {
+    const char *content = (const char *) (chunk + 1);
+    return (ChunkReader) { content, content + chunk->sizeContent };
 }
 
-/* Makes a PM_ANIMATED sheet */
-Image makeAnimatedSheet(ParsedVox vox) {
-    /* Determine the size of the resulting sheet */
-    uint32_t width = 0, height = 0;
-    for (uint32_t i = 0; i < vox.numModels; ++i) {
-        const SizeChunk *size = vox.sizeChunks[i];
-        uint32_t thisWidth = size->x * size->z;
-        if (thisWidth > width) width = thisWidth;
-        height += size->y;
+/* Reads a 32 bit integer, they aren't aligned in scene graph chunks */
+static int32_t readChunkInt(ChunkReader *reader) {
+    int32_t value = 0;
+    if (reader->end - reader->position >= 4) memcpy(&value, reader->position, 4);
+    reader->position += 4;
+    return value;
+}
+
+/* Reads a string, and copies it into value when value isn't NULL */
+static void readChunkString(ChunkReader *reader, char *value, size_t size) {
+    int32_t length = readChunkInt(reader);
+    if (length < 0 || length > reader->end - reader->position) length = 0;
+    if (value) {
+        size_t copied = (size_t) length < size - 1 ? (size_t) length : size - 1;
+        memcpy(value, reader->position, copied);
+        value[copied] = '\0';
     }
-    /* Allocate the image data */
-    uint32_t *rgba = calloc(width * height, sizeof(uint32_t));
+    reader->position += length;
+}
 
-    /* Iterate over the keyframes */
-    const SizeChunk *currentSize = NULL;
-    int currentY = 0;
-    for (uint32_t i = 0; i < vox.numModels; ++i) {
-        currentSize = vox.sizeChunks[i];
-        uint32_t voxelCount = vox.voxelChunks[i]->numVoxels;
-        const Voxel *voxels = getVoxels(vox.voxelChunks[i]);
+/* Reads a dictionary and copies the values of the keys that are in keys
+   into values. Values of keys that aren't in the dictionary are "" */
+static void readChunkDict(ChunkReader *reader, const char **keys, char (*values)[32], int numKeys) {
+    for (int i = 0; i < numKeys; ++i) values[i][0] = '\0';
+    int32_t numPairs = readChunkInt(reader);
+    for (int32_t i = 0; i < numPairs && reader->position < reader->end; ++i) {
+        char key[32];
+        readChunkString(reader, key, sizeof(key));
+        int found = -1;
+        for (int j = 0; j < numKeys; ++j) {
+            if (strcmp(key, keys[j]) == 0) found = j;
+        }
+        readChunkString(reader, found >= 0 ? values[found] : NULL, 32);
+    }
+}
+
+/* A rotation and translation of the scene graph. Rotations in MagicaVoxel
+   only swap and flip axes, so everything stays in whole voxels */
+typedef struct {
+    int32_t rotation[3][3];
+    int32_t translation[3];
+} SceneTransform;
+
+/* A node of the scene graph, which is a transform with one child, a
+   group with any number of children, or a shape with a model */
+typedef struct {
+    uint32_t type;
+    int hidden;
+    /* Transforms: the child, the layer and the transform of the first frame */
+    int32_t child, layer;
+    SceneTransform transform;
+    /* Groups: the children, which are read from the chunk when needed */
+    uint32_t numChildren;
+    ChunkReader children;
+    /* Shapes: the model of the first frame */
+    int32_t model;
+} SceneNode;
 
-        /* Iterate over the voxels */
-        for (uint32_t j = 0; j < voxelCount; ++j) {
-            Voxel currentVoxel = voxels[j];
+/* A model placed in the scene */
+typedef struct {
+    uint32_t model;
+    SceneTransform transform;
+} SceneInstance;
 
-            int xOffset = currentVoxel.z * currentSize->x;
-            int x = currentVoxel.x + xOffset;
-            int y = currentY + currentVoxel.y;
-            int index = x + y * width;
+/* Turns the rotation byte of a transform into a matrix. Bits 0-1 and
+   2-3 are the column of the 1 in the first and second row, bits 4-6 are
+   set when the 1 in that row is negative */
+static void decodeSceneRotation(uint32_t bits, int32_t rotation[3][3]) {
+    memset(rotation, 0, sizeof(int32_t) * 9);
+    uint32_t first = bits & 3, second = (bits >> 2) & 3;
+    if (first > 2 || second > 2 || first == second) {
+        first = 0;
+        second = 1;
+        bits = 0;
+    }
+    uint32_t columns[3] = { first, second, 3 - first - second };
+    for (int row = 0; row < 3; ++row) {
+        rotation[row][columns[row]] = bits & (16u << row) ? -1 : 1;
+    }
+}
 
-            rgba[index] = getColor(vox.palette, currentVoxel.colorIndex);
+/* Returns parent applied after child */
+static SceneTransform combineSceneTransforms(SceneTransform parent, SceneTransform child) {
+    SceneTransform result;
+    for (int row = 0; row < 3; ++row) {
+        result.translation[row] = parent.translation[row];
+        for (int column = 0; column < 3; ++column) {
+            result.rotation[row][column] = 0;
+            for (int k = 0; k < 3; ++k) {
+                result.rotation[row][column] += parent.rotation[row][k] * child.rotation[k][column];
+            }
+            result.translation[row] += parent.rotation[row][column] * child.translation[column];
         }
+    }
+    return result;
+}
 
-        currentY += currentSize->y;
+/* Where a voxel of a model ends up in the scene. Models rotate around
+   their center, and the translation moves that center */
+static inline void placeSceneVoxel(const SceneTransform *transform, const SizeChunk *size,
+                                   int32_t x, int32_t y, int32_t z, int32_t *out) {
+    int32_t local[3] = { x - (int32_t) size->x / 2, y - (int32_t) size->y / 2, z - (int32_t) size->z / 2 };
+    for (int row = 0; row < 3; ++row) {
+        out[row] = transform->translation[row];
+        for (int column = 0; column < 3; ++column) out[row] += transform->rotation[row][column] * local[column];
     }
+}
 
-    return (Image) {
-        width, height,
-        rgba
-    };
+/* Walks the scene graph from node id, and adds every visible shape to instances */
+static void collectSceneInstances(const SceneNode *nodes, uint32_t numNodes, const uint8_t *hiddenLayers,
+                                  int32_t id, SceneTransform transform, int depth,
+                                  SceneInstance **instances, uint32_t *numInstances, uint32_t *capacity) {
+    /* The depth check keeps a broken file with a cycle from recursing forever */
+    if (id < 0 || (uint32_t) id >= numNodes || depth > 64) return;
+    const SceneNode *node = &nodes[id];
+    if (node->hidden) return;
+    if (node->type == TransformId) {
+        if (node->layer >= 0 && node->layer < 256 && hiddenLayers[node->layer]) return;
+        collectSceneInstances(nodes, numNodes, hiddenLayers, node->child,
+                              combineSceneTransforms(transform, node->transform), depth + 1,
+                              instances, numInstances, capacity);
+    }
+    else if (node->type == GroupId) {
+        ChunkReader children = node->children;
+        for (uint32_t i = 0; i < node->numChildren; ++i) {
+            collectSceneInstances(nodes, numNodes, hiddenLayers, readChunkInt(&children), transform, depth + 1,
+                                  instances, numInstances, capacity);
+        }
+    }
+    else if (node->type == ShapeId) {
+        if (*numInstances == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 16;
+            *instances = realloc(*instances, sizeof(SceneInstance) * *capacity);
+        }
+        (*instances)[(*numInstances)++] = (SceneInstance) { (uint32_t) node->model, transform };
+    }
 }
 
-/* Makes the other sheets */
-Image makeSheet(ParsedVox vox, PackingMode mode) {
-    /* TODO: Clean this function up */
+/* Flattens the scene graph of newer .vox files into a single model with
+   every visible shape placed where it is in the scene. Only the first
+   frame of animated transforms and shapes is used. Returns a new
+   ParsedVox that owns its chunks, or vox itself when the file doesn't
+   have a scene graph */
+ParsedVox flattenScene(size_t len, const char *buf, ParsedVox vox) {
+    /* Read the nodes, indexed by their id */
+    SceneNode *nodes = NULL;
+    uint32_t numNodes = 0;
+    uint8_t hiddenLayers[256] = { 0 };
+    const ChunkHeader *chunk = (const ChunkHeader *) ((const FileHeader *) buf + 1);
+    while ((const char *) (chunk + 1) <= buf + len) {
+        uint32_t id = chunk->id;
+        ChunkReader reader = makeChunkReader(chunk);
+        if (reader.end > buf + len) break;
+        if (id == TransformId || id == GroupId || id == ShapeId) {
+            int32_t nodeId = readChunkInt(&reader);
+            if (nodeId >= 0 && nodeId < 1 << 20) {
+                if ((uint32_t) nodeId >= numNodes) {
+                    nodes = realloc(nodes, sizeof(SceneNode) * (nodeId + 1));
+                    memset(nodes + numNodes, 0, sizeof(SceneNode) * (nodeId + 1 - numNodes));
+                    numNodes = nodeId + 1;
+                }
+                SceneNode *node = &nodes[nodeId];
+                const char *keys[3] = { "_hidden", "_r", "_t" };
+                char values[3][32];
+                readChunkDict(&reader, keys, values, 1);
+                node->type = id;
+                node->hidden = strcmp(values[0], "1") == 0;
+                if (id == TransformId) {
+                    node->child = readChunkInt(&reader);
+                    readChunkInt(&reader);
+                    node->layer = readChunkInt(&reader);
+                    int32_t numFrames = readChunkInt(&reader);
+                    readChunkDict(&reader, keys + 1, values + 1, numFrames > 0 ? 2 : 0);
+                    decodeSceneRotation(values[1][0] ? (uint32_t) atoi(values[1]) : 4, node->transform.rotation);
+                    int32_t *t = node->transform.translation;
+                    t[0] = t[1] = t[2] = 0;
+                    sscanf(values[2], "%d %d %d", &t[0], &t[1], &t[2]);
+                }
+                else if (id == GroupId) {
+                    int32_t numChildren = readChunkInt(&reader);
+                    node->numChildren = numChildren > 0 ? (uint32_t) numChildren : 0;
+                    node->children = reader;
+                }
+                else {
+                    node->model = readChunkInt(&reader) > 0 ? readChunkInt(&reader) : -1;
+                }
+            }
+        }
+        else if (id == LayerId) {
+            int32_t layer = readChunkInt(&reader);
+            const char *keys[1] = { "_hidden" };
+            char values[1][32];
+            readChunkDict(&reader, keys, values, 1);
+            if (layer >= 0 && layer < 256) hiddenLayers[layer] = strcmp(values[0], "1") == 0;
+        }
+        chunk = (const ChunkHeader *) ((const char *) (chunk + 1) + chunk->sizeContent);
+    }
+    if (numNodes == 0) return vox;
 
-    int width, height;
-    int xCells;
-    const SizeChunk *size = vox.sizeChunks[0];
-    int voxXDim = (int) size->x;
-    int voxYDim = (int) size->y;
-    int voxZDim = (int) size->z;
-    if (mode == PM_HORIZONTAL || mode == PM_GAMEMAKER) {
-        width = voxXDim * voxZDim;
-        height = voxYDim;
-        xCells = voxZDim;
-    } else if (mode == PM_VERTICAL || mode == PM_MULTIFILE) {
-        width = voxXDim;
-        height = voxYDim * voxZDim;
-        xCells = 1;
-    } else if (mode == PM_SQUARE) {
-        int squareCells = (int) ceil(sqrt(voxZDim));
-        width = voxXDim * squareCells;
-        height = voxYDim * squareCells;
-        xCells = squareCells;
+    SceneInstance *instances = NULL;
+    uint32_t numInstances = 0, capacity = 0;
+    SceneTransform identity = { { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } }, { 0, 0, 0 } };
+    collectSceneInstances(nodes, numNodes, hiddenLayers, 0, identity, 0, &instances, &numInstances, &capacity);
+    free(nodes);
+
+    /* Find the box around every placed model, and where the voxels of
+       every instance go in the combined voxel chunk */
+    int32_t min[3] = { INT32_MAX, INT32_MAX, INT32_MAX }, max[3] = { INT32_MIN, INT32_MIN, INT32_MIN };
+    size_t *firstVoxel = malloc(sizeof(size_t) * (numInstances + 1));
+    firstVoxel[0] = 0;
+    uint32_t numPlaced = 0;
+    for (uint32_t i = 0; i < numInstances; ++i) {
+        SceneInstance instance = instances[i];
+        firstVoxel[numPlaced + 1] = firstVoxel[numPlaced];
+        if (instance.model >= vox.numModels) continue;
+        const SizeChunk *size = vox.sizeChunks[instance.model];
+        for (int corner = 0; corner < 8; ++corner) {
+            int32_t placed[3];
+            placeSceneVoxel(&instance.transform, size, corner & 1 ? size->x - 1 : 0,
+                            corner & 2 ? size->y - 1 : 0, corner & 4 ? size->z - 1 : 0, placed);
+            for (int axis = 0; axis < 3; ++axis) {
+                if (placed[axis] < min[axis]) min[axis] = placed[axis];
+                if (placed[axis] > max[axis]) max[axis] = placed[axis];
+            }
+        }
+        instances[numPlaced++] = instance;
+        firstVoxel[numPlaced] += vox.voxelChunks[instance.model]->numVoxels;
+    }
+    if (numPlaced == 0) {
+        fputs("Warning: The scene graph doesn't show any models, not flattening\n", stderr);
+        free(firstVoxel);
+        free(instances);
+        return vox;
+    }
+    uint32_t sizes[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        sizes[axis] = (uint32_t) (max[axis] - min[axis] + 1);
+    }
+    if (sizes[0] > 256 || sizes[1] > 256 || sizes[2] > 256) {
+        fprintf(stderr, "Error: The scene is %ux%ux%u voxels, but can be at most 256 on every axis\n",
+                sizes[0], sizes[1], sizes[2]);
+        exit(-1);
+    }
+
+    /* Make the combined model, the size chunk first and then the voxel chunk */
+    size_t totalVoxels = firstVoxel[numPlaced];
+    char *owned = malloc(sizeof(SizeChunk) + sizeof(VoxelChunk) + sizeof(Voxel) * totalVoxels);
+    SizeChunk *size = (SizeChunk *) owned;
+    VoxelChunk *voxelChunk = (VoxelChunk *) (size + 1);
+    Voxel *voxels = (Voxel *) (voxelChunk + 1);
+    *size = *vox.sizeChunks[0];
+    size->x = sizes[0];
+    size->y = sizes[1];
+    size->z = sizes[2];
+    *voxelChunk = *vox.voxelChunks[0];
+    voxelChunk->numVoxels = (uint32_t) totalVoxels;
+    voxelChunk->header.sizeContent = (uint32_t) (sizeof(uint32_t) + sizeof(Voxel) * totalVoxels);
+
+    /* Every instance writes its own range of voxels, in the order of the
+       scene so later shapes still win where they overlap */
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) numPlaced; ++i) {
+        SceneInstance instance = instances[i];
+        const SizeChunk *modelSize = vox.sizeChunks[instance.model];
+        const VoxelChunk *modelVoxels = vox.voxelChunks[instance.model];
+        const Voxel *source = getVoxels(modelVoxels);
+        Voxel *out = voxels + firstVoxel[i];
+        for (uint32_t j = 0; j < modelVoxels->numVoxels; ++j) {
+            int32_t placed[3];
+            placeSceneVoxel(&instance.transform, modelSize, source[j].x, source[j].y, source[j].z, placed);
+            out[j] = (Voxel) {
+                (uint8_t) (placed[0] - min[0]), (uint8_t) (placed[1] - min[1]), (uint8_t) (placed[2] - min[2]),
+                source[j].colorIndex
+            };
+        }
     }
+    printInfo("Flattened %u shapes into a %ux%ux%u model\n", numPlaced, sizes[0], sizes[1], sizes[2]);
 
-    const VoxelChunk *voxChunk = vox.voxelChunks[0];
-    const Voxel *voxels = getVoxels(voxChunk);
-    uint32_t *data = calloc(width * height, sizeof(uint32_t));
-    for (uint32_t i = 0; i < voxChunk->numVoxels; ++i) {
-        Voxel currentVoxel = voxels[i];
+    ParsedVox flat = vox;
+    flat.numModels = 1;
+    flat.sizeChunks = malloc(sizeof(SizeChunk *));
+    flat.voxelChunks = malloc(sizeof(VoxelChunk *));
+    flat.sizeChunks[0] = size;
+    flat.voxelChunks[0] = voxelChunk;
+    flat.ownedChunks = owned;
+    free(firstVoxel);
+    free(instances);
+    return flat;
+}
 
-        int x = currentVoxel.x + currentVoxel.z % xCells * voxXDim;
-        int y = currentVoxel.y + currentVoxel.z / xCells * voxYDim;
-        int index = x + y * width;
+/* A growable byte buffer */
+typedef struct {
+    unsigned char *data;
+    size_t length, capacity;
+} ByteBuffer;
 
-        data[index] = getColor(vox.palette, currentVoxel.colorIndex);
+/* Appends length bytes to a ByteBuffer and returns where they went */
+static size_t appendBytes(ByteBuffer *buffer, const void *data, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        buffer->capacity = (buffer->length + length) * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
     }
+    size_t offset = buffer->length;
+    if (data) {
+        memcpy(buffer->data + offset, data, length);
+    }
+    else {
+        memset(buffer->data + offset, 0, length);
+    }
+    buffer->length += length;
+    return offset;
+}
 
-    return (Image) {
-        width, height,
-        data
-    };
+/* Stores a 32 bit value as 4 little endian bytes */
+static void putLittleEndian(unsigned char *out, uint32_t value) {
+    out[0] = (unsigned char) value;
+    out[1] = (unsigned char) (value >> 8);
+    out[2] = (unsigned char) (value >> 16);
+    out[3] = (unsigned char) (value >> 24);
 }
 
-void writeImage(Image img, const char *path) {
-    if (!stbi_write_png(path, img.width, img.height, 4, img.rgba, img.width * 4)) {
-        fputs("Error: Failed to write png file\n", stderr);
+/* Appends a 32 bit value to a ByteBuffer as little endian and returns where it went */
+static size_t appendLittleEndian(ByteBuffer *buffer, uint32_t value) {
+    unsigned char bytes[4];
+    putLittleEndian(bytes, value);
+    return appendBytes(buffer, bytes, 4);
+}
+
+/* Reads count bytes from handle into data, or skips them when data is
+   NULL. Returns whether all of them were there */
+static int readBytes(FILE *handle, void *data, size_t count) {
+    if (data) return fread(data, 1, count, handle) == count;
+    /* Pipes can't seek, so read what's skipped there */
+    if (count <= LONG_MAX && fseek(handle, (long) count, SEEK_CUR) == 0) return 1;
+    char scratch[4096];
+    while (count > 0) {
+        size_t part = count < sizeof(scratch) ? count : sizeof(scratch);
+        if (fread(scratch, 1, part, handle) != part) return 0;
+        count -= part;
     }
+    return 1;
 }
 
-int main(int argc, char **argv) {
-    CLArgs args = parseArgs(argc, argv);
+/* Reads a .vox file chunk by chunk, from stdin when path is -. Only the
+   chunks that parseVox and flattenScene use are kept, the others (like
+   materials and render settings) are skipped without being buffered.
+   buf receives the file header and the kept chunks, which is a valid
+   .vox file by itself */
+void readVox(const char *path, size_t *len, char **buf) {
+    static const uint32_t *keptIds[] = {
+        &PackId, &SizeId, &VoxelId, &PaletteId, &TransformId, &GroupId, &ShapeId, &LayerId
+    };
+    FILE *handle = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!handle) {
+        fputs("Error: Could not read file, are you sure it exists?\n", stderr);
+        exit(-1);
+    }
+    ByteBuffer buffer = { NULL, 0, 0 };
+    /* The file header and the MAIN chunk that every other chunk is in */
+    size_t headerLength = sizeof(FileHeader) + sizeof(ChunkHeader);
+    appendBytes(&buffer, NULL, headerLength);
+    int ok = readBytes(handle, buffer.data, headerLength);
+    ChunkHeader header;
+    while (ok && fread(&header, sizeof(header), 1, handle) == 1) {
+        int kept = 0;
+        for (size_t i = 0; i < sizeof(keptIds) / sizeof(keptIds[0]); ++i) {
+            if (header.id == *keptIds[i]) kept = 1;
+        }
+        if (kept) {
+            appendBytes(&buffer, &header, sizeof(header));
+            size_t offset = appendBytes(&buffer, NULL, header.sizeContent);
+            ok = readBytes(handle, buffer.data + offset, header.sizeContent);
+        }
+        else {
+            ok = readBytes(handle, NULL, header.sizeContent);
+        }
+    }
+    if (!ok || ferror(handle)) {
+        fputs("Error: Vox file is truncated\n", stderr);
+        exit(-1);
+    }
+    if (handle != stdin) fclose(handle);
+    *len = buffer.length;
+    *buf = (char *) buffer.data;
+}
+
+/* The limits of an IoQueue */
+enum {
+    /* How many requests io_uring has going at once */
+    IoQueueDepth = 64,
+    /* How many threads do the requests without io_uring */
+    IoThreads = 4,
+    /* How many files --batch reads ahead of the one it converts */
+    IoReadAhead = 8,
+};
 
-    char *voxBuffer;
-    size_t voxLength;
-    readFile(args.inFile, &voxLength, &voxBuffer);
+/* How an IoQueue does its work */
+typedef enum {
+    /* Everything is done right away, with blocking stdio calls */
+    IO_SYNC,
+    /* A few threads do the blocking calls in the background */
+    IO_THREADS,
+    /* The kernel does everything in the background */
+    IO_URING,
+    IO_SIZE
+} IoBackend;
 
-    ParsedVox parsed = parseVox(voxLength, voxBuffer);
+/* The names of the IoBackends for --io */
+const char *ioBackendNames[] = {
+    "sync",
+    "threads",
+    "uring"
+};
 
-    Image img;
+/* A read of a whole file, or a write of a buffer to a file, that's done
+   in the background by an IoQueue */
+typedef struct IoRequest {
+    int isWrite;
+    /* The data that's read or written, and how much of it is done */
+    char *data;
+    size_t size, done;
+    /* The open file when io_uring does the request, otherwise -1 */
+    int fd;
+    /* Set when the request is done, and when it went wrong */
+    int finished, failed;
+    /* The next request that waits for a thread */
+    struct IoRequest *next;
+    /* The file, allocated along with the request so it's never cut short */
+    char path[];
+} IoRequest;
+
+/* Reads and writes files in the background */
+typedef struct {
+    IoBackend backend;
+    /* The writes that haven't finished yet */
+    uint32_t pendingWrites;
+#ifdef HAVE_IO_URING
+    int ring;
+    uint32_t numEntries, inFlight;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqMap, *cqMap;
+    size_t sqMapSize, cqMapSize, sqesSize;
+#endif
+#ifndef _WIN32
+    pthread_t workers[IoThreads];
+    pthread_mutex_t lock;
+    pthread_cond_t queued, finished;
+    IoRequest *queue, *queueTail;
+    int stopping;
+#endif
+} IoQueue;
 
-    if (args.mode == PM_ANIMATED) {
-        img = makeAnimatedSheet(parsed);
-        writeImage(img, args.outFile);
+/* Does a request with blocking stdio calls */
+static void performIo(IoRequest *request) {
+    FILE *handle = fopen(request->path, request->isWrite ? "wb" : "rb");
+    if (!handle) {
+        request->failed = 1;
+        return;
+    }
+    if (request->isWrite) {
+        request->failed = fwrite(request->data, 1, request->size, handle) != request->size;
     }
     else {
-        /* TODO: Clean this up */
+        fseek(handle, 0, SEEK_END);
+        long length = ftell(handle);
+        fseek(handle, 0, SEEK_SET);
+        request->size = length > 0 ? (size_t) length : 0;
+        request->data = malloc(request->size + 1);
+        request->failed = length < 0 || fread(request->data, 1, request->size, handle) != request->size;
+    }
+    if (fclose(handle) != 0) request->failed = 1;
+}
+
+/* Marks a request as done. Nobody waits for writes, so those are freed here */
+static void finishIoRequest(IoQueue *queue, IoRequest *request) {
+    if (!request->isWrite) {
+        request->finished = 1;
+        return;
+    }
+    if (request->failed) {
+        fprintf(stderr, "Error: Failed to write %s\n", request->path);
+    }
+    queue->pendingWrites--;
+    free(request->data);
+    free(request);
+}
+
+#ifdef HAVE_IO_URING
+/* Sets up an io_uring and maps its rings, returns whether that worked.
+   It doesn't on kernels before 5.7, or where io_uring is blocked */
+static int setupUring(IoQueue *queue) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = (int) syscall(__NR_io_uring_setup, IoQueueDepth, &params);
+    if (ring < 0) return 0;
+    /* Opening files needs 5.6, and fast polling came right after that */
+    if (!(params.features & IORING_FEAT_FAST_POLL)) {
+        close(ring);
+        return 0;
+    }
+    queue->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    queue->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap && queue->cqMapSize > queue->sqMapSize) queue->sqMapSize = queue->cqMapSize;
+    queue->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    queue->sqMap = mmap(NULL, queue->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring, IORING_OFF_SQ_RING);
+    queue->cqMap = singleMap ? queue->sqMap :
+                   mmap(NULL, queue->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, queue->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring, IORING_OFF_SQES);
+    if (queue->sqMap == MAP_FAILED || queue->cqMap == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring);
+        return 0;
+    }
 
-        img = makeSheet(parsed, args.mode);
-        char nameBuffer[128];
-        const SizeChunk *size = parsed.sizeChunks[0];
+    char *sq = queue->sqMap, *cq = queue->cqMap;
+    queue->ring = ring;
+    queue->numEntries = params.sq_entries;
+    queue->inFlight = 0;
+    queue->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    queue->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    queue->sqArray = (unsigned *) (sq + params.sq_off.array);
+    queue->cqHead = (unsigned *) (cq + params.cq_off.head);
+    queue->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    queue->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    queue->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    queue->sqes = sqes;
+    return 1;
+}
 
-        if (args.mode == PM_MULTIFILE) {
-            uint32_t *baseImg = img.rgba;
+static void continueUring(IoQueue *queue, IoRequest *request, int result);
 
-            for (uint32_t i = 0; i < size->z; ++i) {
-                snprintf(nameBuffer, sizeof(nameBuffer) - 1, "%s%03i.png", args.outFile, (int) i);
-                img.rgba = baseImg + size->x * size->y * i;
-                writeImage(img, nameBuffer);
-            }
-            img.rgba = baseImg;
+/* Hands the next step of a request to the kernel: opening its file while
+   it doesn't have one, and reading or writing the rest of it after that.
+   When the kernel won't take it the request fails */
+static void submitUring(IoQueue *queue, IoRequest *request) {
+    unsigned tail = *queue->sqTail;
+    unsigned index = tail & *queue->sqMask;
+    struct io_uring_sqe *sqe = &queue->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (request->fd < 0) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t) request->path;
+        sqe->open_flags = request->isWrite ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+        sqe->len = 0644;
+    }
+    else {
+        /* A single read or write can't be 2 GB or bigger */
+        size_t left = request->size - request->done;
+        sqe->opcode = request->isWrite ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = request->fd;
+        sqe->addr = (uintptr_t) (request->data + request->done);
+        sqe->len = left > (1u << 30) ? (1u << 30) : (uint32_t) left;
+        sqe->off = request->done;
+    }
+    sqe->user_data = (uintptr_t) request;
+    queue->sqArray[index] = index;
+    __atomic_store_n(queue->sqTail, tail + 1, __ATOMIC_RELEASE);
+    queue->inFlight++;
+    while (syscall(__NR_io_uring_enter, queue->ring, 1, 0, 0, NULL, 0) < 0) {
+        if (errno == EINTR || errno == EAGAIN) continue;
+        /* Take the entry back, so a later submit doesn't pick it up */
+        int error = errno;
+        __atomic_store_n(queue->sqTail, tail, __ATOMIC_RELEASE);
+        queue->inFlight--;
+        continueUring(queue, request, -error);
+        return;
+    }
+}
+
+/* Carries on with a request after the kernel finished a step of it */
+static void continueUring(IoQueue *queue, IoRequest *request, int result) {
+    if (result < 0 || (request->fd >= 0 && result == 0)) {
+        /* It failed, or the file got shorter while it was read */
+        request->failed = 1;
+    }
+    else if (request->fd < 0) {
+        request->fd = result;
+        struct stat status;
+        if (!request->isWrite && fstat(request->fd, &status) == 0) {
+            request->size = (size_t) status.st_size;
+            request->data = malloc(request->size + 1);
         }
-        else if (args.mode == PM_GAMEMAKER) {
-            snprintf(nameBuffer, sizeof(nameBuffer) - 1, "%s_strip%02i.png", args.outFile, size->z);
-            writeImage(img, nameBuffer);
+        else if (!request->isWrite) {
+            request->failed = 1;
         }
-        else {
-            writeImage(img, args.outFile);
+    }
+    else {
+        request->done += (size_t) result;
+    }
+
+    if (!request->failed && (request->done < request->size || request->fd < 0)) {
+        submitUring(queue, request);
+        return;
+    }
+    if (request->fd >= 0) close(request->fd);
+    finishIoRequest(queue, request);
+}
+
+/* Waits until the kernel finished at least one step, and carries on with
+   the requests of all finished steps */
+static void reapUring(IoQueue *queue) {
+    unsigned head = *queue->cqHead;
+    while (head == __atomic_load_n(queue->cqTail, __ATOMIC_ACQUIRE)) {
+        if (syscall(__NR_io_uring_enter, queue->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR && errno != EAGAIN) {
+            fputs("Error: Failed to wait for io_uring\n", stderr);
+            exit(-1);
         }
     }
+    unsigned tail = __atomic_load_n(queue->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe *cqe = &queue->cqes[head & *queue->cqMask];
+        IoRequest *request = (IoRequest *) (uintptr_t) cqe->user_data;
+        int result = cqe->res;
+        __atomic_store_n(queue->cqHead, head + 1, __ATOMIC_RELEASE);
+        queue->inFlight--;
+        continueUring(queue, request, result);
+    }
+}
+#endif
 
-    puts("Done");
+#ifndef _WIN32
+/* Does the requests of an IoQueue one after the other, until it's ended */
+static void *runIoThread(void *argument) {
+    IoQueue *queue = argument;
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        while (!queue->queue && !queue->stopping) {
+            pthread_cond_wait(&queue->queued, &queue->lock);
+        }
+        IoRequest *request = queue->queue;
+        if (!request) break;
+        queue->queue = request->next;
+        pthread_mutex_unlock(&queue->lock);
+        performIo(request);
+        pthread_mutex_lock(&queue->lock);
+        finishIoRequest(queue, request);
+        pthread_cond_broadcast(&queue->finished);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+#endif
 
-    freeImage(img);
-    freeParsedVox(parsed);
-    free(voxBuffer);
-    return 0;
+/* Makes an IoQueue that uses backend, or the best one there is when
+   backend is IO_SIZE. io_uring falls back to threads when the kernel
+   doesn't have it, and threads fall back to blocking calls on Windows */
+IoQueue *beginIo(IoBackend backend) {
+    IoQueue *queue = calloc(1, sizeof(IoQueue));
+    if (backend == IO_SIZE) backend = IO_URING;
+    queue->backend = IO_SYNC;
+#ifdef HAVE_IO_URING
+    if (backend == IO_URING && setupUring(queue)) {
+        queue->backend = IO_URING;
+        return queue;
+    }
+#endif
+#ifndef _WIN32
+    if (backend != IO_SYNC) {
+        queue->backend = IO_THREADS;
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->queued, NULL);
+        pthread_cond_init(&queue->finished, NULL);
+        for (int i = 0; i < IoThreads; ++i) {
+            pthread_create(&queue->workers[i], NULL, runIoThread, queue);
+        }
+    }
+#endif
+    return queue;
 }
 
+/* Starts a request. This can be done from any thread */
+static void startIoRequest(IoQueue *queue, IoRequest *request) {
+#ifndef _WIN32
+    if (queue->backend == IO_THREADS) {
+        pthread_mutex_lock(&queue->lock);
+        if (request->isWrite) queue->pendingWrites++;
+        if (queue->queue) queue->queueTail->next = request;
+        else queue->queue = request;
+        queue->queueTail = request;
+        pthread_cond_signal(&queue->queued);
+        pthread_mutex_unlock(&queue->lock);
+        return;
+    }
+#endif
+    #pragma omp critical (io)
+    {
+        if (request->isWrite) queue->pendingWrites++;
+#ifdef HAVE_IO_URING
+        if (queue->backend == IO_URING) {
+            while (queue->inFlight >= queue->numEntries) reapUring(queue);
+            submitUring(queue, request);
+        }
+#endif
+    }
+    if (queue->backend == IO_SYNC) {
+        performIo(request);
+        #pragma omp critical (io)
+        finishIoRequest(queue, request);
+    }
+}
+
+/* Makes a request for a file, with room for its whole path */
+static IoRequest *newIoRequest(const char *path) {
+    size_t pathLength = strlen(path) + 1;
+    IoRequest *request = calloc(1, sizeof(IoRequest) + pathLength);
+    memcpy(request->path, path, pathLength);
+    request->fd = -1;
+    return request;
+}
+
+/* Starts reading a whole file, wait for it with waitIo */
+IoRequest *submitRead(IoQueue *queue, const char *path) {
+    IoRequest *request = newIoRequest(path);
+    startIoRequest(queue, request);
+    return request;
+}
+
+/* Starts writing size bytes of data to a file, and frees data when that's done */
+void submitWrite(IoQueue *queue, const char *path, char *data, size_t size) {
+    IoRequest *request = newIoRequest(path);
+    request->isWrite = 1;
+    request->data = data;
+    request->size = size;
+    startIoRequest(queue, request);
+}
+
+/* Waits until a read is done */
+void waitIo(IoQueue *queue, IoRequest *request) {
+#ifdef HAVE_IO_URING
+    if (queue->backend == IO_URING) {
+        /* Let go in between, so other threads can still submit */
+        int finished = 0;
+        while (!finished) {
+            #pragma omp critical (io)
+            {
+                if (!request->finished) reapUring(queue);
+                finished = request->finished;
+            }
+        }
+    }
+#endif
+#ifndef _WIN32
+    if (queue->backend == IO_THREADS) {
+        pthread_mutex_lock(&queue->lock);
+        while (!request->finished) pthread_cond_wait(&queue->finished, &queue->lock);
+        pthread_mutex_unlock(&queue->lock);
+    }
+#endif
+    (void) queue;
+    (void) request;
+}
+
+/* Frees a read and its data */
+void freeIoRequest(IoRequest *request) {
+    free(request->data);
+    free(request);
+}
+
+/* Waits for all writes to finish and frees an IoQueue */
+void endIo(IoQueue *queue) {
+#ifdef HAVE_IO_URING
+    if (queue->backend == IO_URING) {
+        while (queue->pendingWrites > 0) reapUring(queue);
+        munmap(queue->sqes, queue->sqesSize);
+        if (queue->cqMap != queue->sqMap) munmap(queue->cqMap, queue->cqMapSize);
+        munmap(queue->sqMap, queue->sqMapSize);
+        close(queue->ring);
+    }
+#endif
+#ifndef _WIN32
+    if (queue->backend == IO_THREADS) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->pendingWrites > 0) pthread_cond_wait(&queue->finished, &queue->lock);
+        queue->stopping = 1;
+        pthread_cond_broadcast(&queue->queued);
+        pthread_mutex_unlock(&queue->lock);
+        for (int i = 0; i < IoThreads; ++i) {
+            pthread_join(queue->workers[i], NULL);
+        }
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->queued);
+        pthread_cond_destroy(&queue->finished);
+    }
+#endif
+    free(queue);
+}
+
+/* The IoQueue that output files are written with in --batch, or NULL */
+static IoQueue *outputQueue = NULL;
+
+/* A file that's being written into the --tar archive. It's kept in memory
+   until it's closed, and then added to the archive in one go */
+typedef struct OpenMember {
+    FILE *handle;
+    char *data;
+    size_t size;
+    struct OpenMember *next;
+} OpenMember;
+
+/* The tar archive that every output file goes into with --tar, or NULL */
+static FILE *archive = NULL;
+/* The size of the archive so far, and a line per member for its index */
+static uint64_t archiveLength = 0;
+static ByteBuffer archiveIndex = { NULL, 0, 0 };
+static OpenMember *openMembers = NULL;
+
+/* Writes an octal number of digits digits followed by a NUL into a tar header field */
+static void putTarNumber(char *field, uint64_t value, int digits) {
+    for (int i = digits - 1; i >= 0; --i) {
+        field[i] = (char) ('0' + (value & 7));
+        value >>= 3;
+    }
+    field[digits] = '\0';
+}
+
+/* Adds a file to the archive. Leading slashes are left out of its name,
+   names that don't fit into 100 bytes are split into a prefix at a slash */
+static void appendArchiveMember(const char *path, const char *data, size_t size) {
+    while (*path == '/') path++;
+    char header[512] = { 0 };
+    size_t nameLength = strlen(path);
+    const char *name = path;
+    if (nameLength > 100) {
+        const char *split = path + nameLength - 101;
+        while (*split && *split != '/') split++;
+        if (!*split || split - path > 155) {
+            fprintf(stderr, "Error: %s is too long a name for a tar archive\n", path);
+            exit(-1);
+        }
+        memcpy(header + 345, path, split - path);
+        name = split + 1;
+    }
+    memcpy(header, name, strlen(name));
+    putTarNumber(header + 100, 0644, 7);
+    putTarNumber(header + 108, 0, 7);
+    putTarNumber(header + 116, 0, 7);
+    putTarNumber(header + 124, size, 11);
+    putTarNumber(header + 136, (uint64_t) time(NULL), 11);
+    header[156] = '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    /* The checksum is taken with the checksum field filled with spaces */
+    memset(header + 148, ' ', 8);
+    uint32_t checksum = 0;
+    for (int i = 0; i < 512; ++i) checksum += (unsigned char) header[i];
+    putTarNumber(header + 148, checksum, 6);
+    header[155] = ' ';
+
+    static const char padding[512] = { 0 };
+    size_t paddingLength = (512 - size % 512) % 512;
+    fwrite(header, 1, sizeof(header), archive);
+    fwrite(data, 1, size, archive);
+    fwrite(padding, 1, paddingLength, archive);
+
+    char line[256];
+    int lineLength = snprintf(line, sizeof(line), "%llu %llu %s\n", (unsigned long long) archiveLength + 512,
+                              (unsigned long long) size, path);
+    appendBytes(&archiveIndex, line, lineLength < (int) sizeof(line) ? lineLength : (int) sizeof(line) - 1);
+    archiveLength += 512 + size + paddingLength;
+}
+
+/* Makes every file that's written from now on go into a tar archive at
+   path, or to stdout when path is - */
+void beginArchive(const char *path) {
+#ifdef _WIN32
+    fputs("Error: --tar isn't supported on Windows\n", stderr);
+    exit(-1);
+#endif
+    archive = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (!archive) {
+        fputs("Error: Failed to write tar file\n", stderr);
+        exit(-1);
+    }
+}
+
+/* Ends the archive with an index of its members, index.txt, which lists
+   the offset of every member's data in the archive, its size and its name */
+void endArchive(void) {
+    appendArchiveMember("index.txt", (const char *) archiveIndex.data, archiveIndex.length);
+    static const char end[1024] = { 0 };
+    fwrite(end, 1, sizeof(end), archive);
+    int ok = !ferror(archive);
+    ok = (archive == stdout ? fflush(archive) : fclose(archive)) == 0 && ok;
+    if (!ok) {
+        fputs("Error: Failed to write tar file\n", stderr);
+    }
+    free(archiveIndex.data);
+    archive = NULL;
+}
+
+/* Opens a file to write to, which is stdout when path is - and a file in
+   memory when there's an archive or an outputQueue */
+FILE *openOutput(const char *path) {
+    if (strcmp(path, "-") == 0) return stdout;
+    if (!archive && !outputQueue) return fopen(path, "wb");
+#ifndef _WIN32
+    OpenMember *member = calloc(1, sizeof(OpenMember));
+    member->handle = open_memstream(&member->data, &member->size);
+    if (!member->handle) {
+        free(member);
+        return NULL;
+    }
+    #pragma omp critical (archive)
+    {
+        member->next = openMembers;
+        openMembers = member;
+    }
+    return member->handle;
+#else
+    return NULL;
+#endif
+}
+
+/* Closes a file from openOutput, and adds it to the archive as path when
+   there is one, or hands it to the outputQueue. Returns whether everything
+   was written so far. The encoders can all do this at the same time, the
+   archive gets one file after the other */
+int closeOutput(FILE *handle, const char *path) {
+    int ok = !ferror(handle);
+    if (handle == stdout) return fflush(handle) == 0 && ok;
+    if (!archive && !outputQueue) return fclose(handle) == 0 && ok;
+
+    OpenMember *member = NULL;
+    #pragma omp critical (archive)
+    {
+        OpenMember **link = &openMembers;
+        while ((*link)->handle != handle) link = &(*link)->next;
+        member = *link;
+        *link = member->next;
+    }
+    ok = fclose(handle) == 0 && ok;
+    if (ok && archive) {
+        #pragma omp critical (archive)
+        appendArchiveMember(path, member->data, member->size);
+    }
+    else if (ok) {
+        submitWrite(outputQueue, path, member->data, member->size);
+        member->data = NULL;
+    }
+    free(member->data);
+    free(member);
+    return ok;
+}
+
+void printUsage(void) {
+    puts("Usage: vox2png [OPTIONS] INPUT.vox OUTPUT.png [PACKING-MODE]");
+    puts("       vox2png [OPTIONS] INPUT.vox... OUTPUT.png atlas");
+    puts("       vox2png --batch [OPTIONS] INPUT.vox... OUTPUT-DIRECTORY [PACKING-MODE]");
+    puts("    Where INPUT.vox is the input file and OUTPUT.png is the output file name");
+    puts("      * Use - for either to read the model from stdin or write the image to stdout");
+    puts("      * You should leave the .png away in OUTPUT when you're using either multifile or gamemaker");
+    puts("    PACKING-MODE can be one of:");
+    puts("      * animated puts depth on the X axis and keyframes on the Y axis");
+    puts("        This is the only mode that supports animation keyframes");
+    puts("      * horizontal puts all cells next to each other on the X axis of the sprite sheet.");
+    puts("      * vertical does the same thing but on the Y axis.");
+    puts("      * square goes left->right and top->bottom, like Minecraft's terrain.png.");
+    puts("      * multifile makes a different file for each cell, don't put .png after the output file in this mode.");
+    puts("      * gamemaker is the same as horizontal, but it adds _stripN after the filename,");
+    puts("        which makes it easier to import in GameMaker. Don't put .png after the output file in this mode.");
+    puts("      * packed crops every cell to its own voxels and packs them as tightly as possible.");
+    puts("        Where every cell ended up is written to OUTPUT.layers.txt. It takes a single model");
+    puts("      * atlas does the same for all models of all input files, and packs them into pages of");
+    puts("        --atlas-size N pixels (2048 by default). Where every cell ended up is written to OUTPUT.atlas.txt");
+    puts("      * rotated draws the stacked layers of every keyframe at --angles N rotations (8 by default),");
+    puts("        next to each other on the X axis, so every sprite is a single cell.");
+    puts("    horizontal, vertical, square, multifile and gamemaker write every model of the file on its own,");
+    puts("    with _00, _01 and so on added to OUTPUT when there's more than one.");
+    puts("    The default PACKING-MODE is animated");
+    puts("    OPTIONS can be any of:");
+    puts("      * --no-flatten keeps the models of files with a scene graph (MagicaVoxel 0.99 and newer) apart,");
+    puts("        instead of putting them together the way they're placed in the scene.");
+    puts("      * --trim crops the models to their voxels and drops empty Z layers.");
+    puts("        Where the trimmed layers were is written to OUTPUT.trim.txt");
+    puts("      * --axes x,y,z makes a sheet of slices along every given axis instead of only along Z,");
+    puts("        in horizontal, vertical or square mode. They're written to OUTPUT_x.png, OUTPUT_y.png and OUTPUT_z.png");
+    puts("      * --modes LIST writes the sheets of several of horizontal, vertical, square, multifile and");
+    puts("        gamemaker from a single rasterization, for example --modes horizontal,square.");
+    puts("        The sheets are written to OUTPUT_MODE.png, except multifile and gamemaker which name their files as usual");
+    puts("      * --cull D removes the voxels that the layer above them hides when the layers are drawn");
+    puts("        at most D pixels apart. Use 1 for layers drawn straight on top of each other.");
+    puts("      * --dedup stores cells that are the same in several keyframes only once in animated mode.");
+    puts("        Which cell every keyframe uses for every layer is written to OUTPUT.frames.txt");
+    puts("      * --apng writes every keyframe as a frame of an animated png in animated mode.");
+    puts("      * --fps N sets the frame rate of --apng, up to 65535. The default is 10.");
+    puts("      * --max-texture-size N splits sheets that are wider or taller than N pixels into pages,");
+    puts("        without cutting through cells. The pages are listed in OUTPUT.pages.txt");
+    puts("      * --squash F scales the layers of rotated by F (between 0 and 1) on the Y axis, to tilt the view.");
+    puts("      * --pot makes the pages of --max-texture-size a power of two in size.");
+    puts("      * --scale N scales the written images up N times, without smoothing.");
+    puts("      * --mipmaps also writes smaller versions of the sheet down to 1 pixel per cell, which are");
+    puts("        downsampled per cell. Cells are padded to a power of two. The levels are written to");
+    puts("        OUTPUT_mipN.png, or into the same file for DDS");
+    puts("      * --qoi writes QOI images instead of pngs, which load a lot faster.");
+    puts("        This is also done when OUTPUT ends in .qoi");
+    puts("      * --bc1 and --bc7 write block compressed DDS textures, which the GPU can use without");
+    puts("        decoding them. Cells are padded to a multiple of 4 pixels. BC7 is also used when OUTPUT ends in .dds");
+    puts("      * --tar FILE writes every file into a single tar archive instead, with an index of its");
+    puts("        contents in index.txt at the end. Use --tar - to write the archive to stdout");
+    puts("      * --layout writes where every cell is, the box around what's drawn in it and how many voxels");
+    puts("        it has to OUTPUT.layout.bin. --layout-json also writes it to OUTPUT.layout.json");
+    puts("      * --shm writes the sheet and where its cells are into the POSIX shared memory segment OUTPUT,");
+    puts("        instead of a file, so a running program can pick it up without decoding anything.");
+    puts("      * --batch converts every input file into a file of the same name in OUTPUT-DIRECTORY,");
+    puts("        reading and writing files in the background while it converts.");
+    puts("      * --io uring|threads|sync picks how --batch does that. The default is io_uring where Linux has it");
+    puts("      * --cold drops the input files from the page cache first, to time a batch on a cold cache.");
+    puts("      * --bundle writes a stacked sprite bundle: the opaque spans of every layer as palette indices,");
+    puts("        laid out to be used straight from memory. This is also done when OUTPUT ends in .vsb");
+    puts("");
+    puts("=== IMPORTANT ===");
+    puts("If you're having trouble with the colors being off, change a color in the vox files color palette.'");
+    puts("This forces MagicaVoxel to save the palette data ensuring that you'll get the right colors.");
+}
+
+/* Describes how the sprites should be packed into the sprite sheet */
+typedef enum {
+    /* Animation keyframes under eachother on the Y axis and
+       depth next to eachother on the X axis */
+    PM_ANIMATED = 0,
+    /* Next to each other on the X axis */
+    PM_HORIZONTAL,
+    /* Next to each other on the Y axis */
+    PM_VERTICAL,
+    /* Left to right and top to bottom */
+    PM_SQUARE,
+    /* One file per sprite */
+    PM_MULTIFILE,
+    /* Like horizontal, but with _stripXX appended to the filename,
+       where XX is the amount of sprites */
+    PM_GAMEMAKER,
+    /* Every layer cropped to its own voxels and packed as tightly as
+       possible, with the positions written to a separate file */
+    PM_PACKED,
+    /* The cropped layers of many input files packed into fixed size pages */
+    PM_ATLAS,
+    /* The stacked layers composited at a number of angles, with the
+       angles on the X axis and keyframes on the Y axis */
+    PM_ROTATED,
+
+    PM_SIZE,
+} PackingMode;
+
+/* The strings used to get the PackingMode from the CLI arguments */
+const char *packingModeStrings[PM_SIZE] = {
+    "animated",
+    "horizontal",
+    "vertical",
+    "square",
+    "multifile",
+    "gamemaker",
+    "packed",
+    "atlas",
+    "rotated",
+};
+
+/* The image file formats that can be written */
+typedef enum {
+    OF_PNG = 0,
+    /* The Quite OK Image format, which is much faster to decode */
+    OF_QOI,
+    /* Block compressed textures in a DirectDraw Surface file */
+    OF_DDS,
+
+    OF_SIZE,
+} OutputFormat;
+
+/* The file extension of every OutputFormat */
+const char *outputFormatExtensions[OF_SIZE] = {
+    ".png",
+    ".qoi",
+    ".dds",
+};
+
+/* The block compression formats of OF_DDS */
+typedef enum {
+    /* 4 bits per pixel, 5:6:5 colors with 1 bit alpha */
+    BF_BC1 = 0,
+    /* 8 bits per pixel, close to the original RGBA */
+    BF_BC7,
+} BlockFormat;
+
+/* The axes the slices of --axes can be taken along */
+typedef enum {
+    AX_X = 0,
+    AX_Y,
+    AX_Z,
+
+    AX_SIZE,
+} SliceAxis;
+
+/* The names of the SliceAxes, used for the option and the output files */
+const char *sliceAxisNames[AX_SIZE] = {
+    "x",
+    "y",
+    "z",
+};
+
+/* The parsed command line arguments */
+typedef struct {
+    const char *inFile;
+    const char *outFile;
+    PackingMode mode;
+    /* All input files, inFile is the first one. Only atlas and --batch take more than one */
+    const char **inFiles;
+    int numInFiles;
+    /* The size of the atlas pages */
+    uint32_t atlasSize;
+    /* Sheets bigger than this are split into pages, 0 to never split */
+    uint32_t maxTextureSize;
+    /* Give every page a power of two size */
+    int powerOfTwo;
+    /* The format of the written images */
+    OutputFormat format;
+    /* The block compression used by OF_DDS */
+    BlockFormat blockFormat;
+    /* Write a stacked sprite bundle instead of images */
+    int bundle;
+    /* Write every file into this tar archive, NULL to write them as they are */
+    const char *tarFile;
+    /* Write the sheet into the shared memory segment outFile instead */
+    int shm;
+    /* Write where the cells are and what's drawn in them next to the sheet, and also as JSON */
+    int layout, layoutJson;
+    /* Convert every input file on its own into the directory outFile */
+    int batch;
+    /* The IoBackend of the batch, IO_SIZE to pick the best one */
+    IoBackend io;
+    /* Drop the input files from the page cache before the batch */
+    int cold;
+    /* Combine the models of the scene graph into one, where the file has one */
+    int flatten;
+    /* Crop the models to the box that contains their voxels */
+    int trim;
+    /* A bit for every SliceAxis to make a sheet for, 0 to only slice along Z */
+    uint32_t axes;
+    /* A bit for every PackingMode to write from a single rasterization, 0 to only write mode */
+    uint32_t modes;
+    /* Remove the voxels hidden by layers drawn at most this far apart, 0 to keep them */
+    uint32_t cullRadius;
+    /* Store identical animated cells only once */
+    int dedup;
+    /* Write the keyframes as the frames of an animated png */
+    int apng;
+    /* The frame rate of the animated png */
+    uint32_t fps;
+    /* How many times the written images are scaled up */
+    uint32_t scale;
+    /* Write a chain of mipmaps that are downsampled per cell */
+    int mipmaps;
+    /* The amount of angles of PM_ROTATED */
+    uint32_t angles;
+    /* How much PM_ROTATED scales the layers on the Y axis */
+    double squash;
+} CLArgs;
+
+/* Returns the positive number that follows option argv[*i] */
+uint32_t parseNumberOption(int argc, char **argv, int *i) {
+    const char *option = argv[*i];
+    char *end = NULL;
+    long value = 0;
+    if (*i + 1 < argc) {
+        value = strtol(argv[++*i], &end, 10);
+    }
+    if (!end || *end != '\0' || value <= 0) {
+        fprintf(stderr, "Error: %s needs a positive number\n", option);
+        exit(-1);
+    }
+    return (uint32_t) value;
+}
+
+/* Returns the number between 0 and 1 that follows option argv[*i] */
+double parseFractionOption(int argc, char **argv, int *i) {
+    const char *option = argv[*i];
+    char *end = NULL;
+    double value = 0;
+    if (*i + 1 < argc) {
+        value = strtod(argv[++*i], &end);
+    }
+    if (!end || *end != '\0' || !(value > 0 && value <= 1)) {
+        fprintf(stderr, "Error: %s needs a number between 0 and 1\n", option);
+        exit(-1);
+    }
+    return value;
+}
+
+/* Returns the comma separated list of names that follows option argv[*i]
+   as bits, where bit n stands for names[n]. NULL names can't be picked */
+uint32_t parseListOption(int argc, char **argv, int *i, const char **names, int numNames, const char *expected) {
+    const char *option = argv[*i];
+    uint32_t bits = 0;
+    const char *list = *i + 1 < argc ? argv[++*i] : "";
+    while (*list) {
+        size_t length = strcspn(list, ",");
+        int found = 0;
+        for (int name = 0; name < numNames; ++name) {
+            if (names[name] && length == strlen(names[name]) && strncmp(list, names[name], length) == 0) {
+                bits |= 1u << name;
+                found = 1;
+            }
+        }
+        if (!found) break;
+        list += length;
+        if (*list == ',') list++;
+    }
+    if (*list || bits == 0) {
+        fprintf(stderr, "Error: %s needs a comma separated list of %s\n", option, expected);
+        exit(-1);
+    }
+    return bits;
+}
+
+/* Parses the command line arguments */
+CLArgs parseArgs(int argc, char **argv) {
+    CLArgs args;
+    args.inFile = NULL;
+    args.outFile = NULL;
+    args.mode = PM_ANIMATED;
+    args.trim = 0;
+    args.flatten = 1;
+    args.cullRadius = 0;
+    args.axes = 0;
+    args.modes = 0;
+    args.dedup = 0;
+    args.apng = 0;
+    args.fps = 10;
+    args.scale = 1;
+    args.mipmaps = 0;
+    args.atlasSize = 2048;
+    args.maxTextureSize = 0;
+    args.powerOfTwo = 0;
+    args.format = OF_PNG;
+    args.blockFormat = BF_BC7;
+    args.bundle = 0;
+    args.tarFile = NULL;
+    args.shm = 0;
+    args.layout = 0;
+    args.layoutJson = 0;
+    args.batch = 0;
+    args.io = IO_SIZE;
+    args.cold = 0;
+    args.angles = 8;
+    args.squash = 1;
+
+    const char **positional = malloc(sizeof(const char *) * argc);
+    int numPositional = 0;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            printUsage();
+            exit(0);
+        }
+        else if (strcmp(arg, "--no-flatten") == 0) {
+            args.flatten = 0;
+        }
+        else if (strcmp(arg, "--trim") == 0) {
+            args.trim = 1;
+        }
+        else if (strcmp(arg, "--axes") == 0) {
+            args.axes = parseListOption(argc, argv, &i, sliceAxisNames, AX_SIZE, "x, y and z");
+        }
+        else if (strcmp(arg, "--modes") == 0) {
+            /* Only the modes that makeSheet handles can be combined */
+            const char *names[PM_SIZE] = { NULL };
+            for (int mode = PM_HORIZONTAL; mode <= PM_GAMEMAKER; ++mode) {
+                names[mode] = packingModeStrings[mode];
+            }
+            args.modes = parseListOption(argc, argv, &i, names, PM_SIZE,
+                                         "horizontal, vertical, square, multifile and gamemaker");
+        }
+        else if (strcmp(arg, "--cull") == 0) {
+            args.cullRadius = parseNumberOption(argc, argv, &i);
+        }
+        else if (strcmp(arg, "--dedup") == 0) {
+            args.dedup = 1;
+        }
+        else if (strcmp(arg, "--apng") == 0) {
+            args.apng = 1;
+        }
+        else if (strcmp(arg, "--fps") == 0) {
+            args.fps = parseNumberOption(argc, argv, &i);
+        }
+        else if (strcmp(arg, "--angles") == 0) {
+            args.angles = parseNumberOption(argc, argv, &i);
+        }
+        else if (strcmp(arg, "--squash") == 0) {
+            args.squash = parseFractionOption(argc, argv, &i);
+        }
+        else if (strcmp(arg, "--mipmaps") == 0) {
+            args.mipmaps = 1;
+        }
+        else if (strcmp(arg, "--scale") == 0) {
+            args.scale = parseNumberOption(argc, argv, &i);
+        }
+        else if (strcmp(arg, "--atlas-size") == 0) {
+            args.atlasSize = parseNumberOption(argc, argv, &i);
+        }
+        else if (strcmp(arg, "--max-texture-size") == 0) {
+            args.maxTextureSize = parseNumberOption(argc, argv, &i);
+        }
+        else if (strcmp(arg, "--pot") == 0) {
+            args.powerOfTwo = 1;
+        }
+        else if (strcmp(arg, "--qoi") == 0) {
+            args.format = OF_QOI;
+        }
+        else if (strcmp(arg, "--bc1") == 0) {
+            args.format = OF_DDS;
+            args.blockFormat = BF_BC1;
+        }
+        else if (strcmp(arg, "--bc7") == 0) {
+            args.format = OF_DDS;
+            args.blockFormat = BF_BC7;
+        }
+        else if (strcmp(arg, "--bundle") == 0) {
+            args.bundle = 1;
+        }
+        else if (strcmp(arg, "--tar") == 0) {
+            if (i + 1 >= argc) {
+                fputs("Error: --tar needs a file name\n", stderr);
+                exit(-1);
+            }
+            args.tarFile = argv[++i];
+        }
+        else if (strcmp(arg, "--shm") == 0) {
+            args.shm = 1;
+        }
+        else if (strcmp(arg, "--layout") == 0) {
+            args.layout = 1;
+        }
+        else if (strcmp(arg, "--layout-json") == 0) {
+            args.layout = 1;
+            args.layoutJson = 1;
+        }
+        else if (strcmp(arg, "--batch") == 0) {
+            args.batch = 1;
+        }
+        else if (strcmp(arg, "--io") == 0) {
+            const char *name = i + 1 < argc ? argv[++i] : "";
+            args.io = IO_SIZE;
+            for (int io = 0; io < IO_SIZE; ++io) {
+                if (strcmp(name, ioBackendNames[io]) == 0) args.io = io;
+            }
+            if (args.io == IO_SIZE) {
+                fputs("Error: --io needs one of sync, threads and uring\n", stderr);
+                exit(-1);
+            }
+        }
+        else if (strcmp(arg, "--cold") == 0) {
+            args.cold = 1;
+        }
+        else if (strncmp(arg, "--", 2) == 0) {
+            fprintf(stderr, "Error: Unknown option %s\n", arg);
+            exit(-1);
+        }
+        else {
+            positional[numPositional++] = arg;
+        }
+    }
+    if (numPositional < 2) {
+        fputs("Error: Wrong number of arguments\n", stderr);
+        printUsage();
+        exit(-1);
+    }
+
+    /* The packing mode is the last argument when there are more than two.
+       A batch can have any number of inputs, so it's only a mode there when it's the name of one */
+    int modeGiven = numPositional > 2;
+    if (args.batch && modeGiven) {
+        modeGiven = 0;
+        for (int i = 0; i < PM_SIZE; ++i) {
+            if (strcmp(positional[numPositional - 1], packingModeStrings[i]) == 0) modeGiven = 1;
+        }
+    }
+    if (modeGiven) {
+        const char *modeString = positional[--numPositional];
+        int found = 0;
+        for (int i = 0; i < PM_SIZE; ++i) {
+            if (strcmp(modeString, packingModeStrings[i]) == 0) {
+                args.mode = i;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fputs("Error: Unknown packing mode\n", stderr);
+            exit(-1);
+        }
+    }
+    if (args.batch && args.mode == PM_ATLAS) {
+        fputs("Error: --batch converts every input file on its own, which atlas doesn't\n", stderr);
+        exit(-1);
+    }
+    if (numPositional > 2 && args.mode != PM_ATLAS && !args.batch) {
+        fputs("Error: Only atlas and --batch can take more than one input file\n", stderr);
+        exit(-1);
+    }
+
+    if (args.scale > 1 && args.format == OF_DDS) {
+        fputs("Error: --scale doesn't work with DDS textures, let the GPU scale those\n", stderr);
+        exit(-1);
+    }
+    if (args.scale > 1 && args.powerOfTwo && (args.scale & (args.scale - 1))) {
+        fputs("Error: --pot needs a --scale that's a power of two\n", stderr);
+        exit(-1);
+    }
+    if (args.mipmaps && (args.mode == PM_PACKED || args.mode == PM_ATLAS || args.apng || args.scale > 1)) {
+        fputs("Error: --mipmaps needs cells of the same size, and doesn't work with --apng or --scale\n", stderr);
+        exit(-1);
+    }
+    if (args.mode == PM_PACKED && (args.maxTextureSize || args.powerOfTwo)) {
+        fputs("Error: A packed sheet is a single page, so it doesn't work with --max-texture-size or --pot\n", stderr);
+        exit(-1);
+    }
+    if (args.modes && (modeGiven || args.axes)) {
+        fputs("Error: --modes can't be combined with a packing mode or --axes\n", stderr);
+        exit(-1);
+    }
+    if (args.modes) {
+        args.mode = PM_VERTICAL;
+    }
+    if (args.apng && args.mode != PM_ANIMATED) {
+        fputs("Error: --apng turns keyframes into frames, so it only works in animated mode\n", stderr);
+        exit(-1);
+    }
+    /* The frame rate goes into the 16 bit delay denominator of the png */
+    if (args.fps > 65535) {
+        fputs("Error: --fps can be at most 65535\n", stderr);
+        exit(-1);
+    }
+    if (args.axes && args.mode != PM_HORIZONTAL && args.mode != PM_VERTICAL && args.mode != PM_SQUARE) {
+        fputs("Error: --axes only works with horizontal, vertical and square\n", stderr);
+        exit(-1);
+    }
+
+    args.inFiles = positional;
+    args.numInFiles = numPositional - 1;
+    args.inFile = positional[0];
+    args.outFile = positional[numPositional - 1];
+    /* The format can also be picked with the extension of the output file */
+    const char *extension = strrchr(args.outFile, '.');
+    for (int i = 0; extension && i < OF_SIZE; ++i) {
+        if (strcmp(extension, outputFormatExtensions[i]) == 0) {
+            args.format = i;
+        }
+    }
+    if (extension && strcmp(extension, ".vsb") == 0) {
+        args.bundle = 1;
+    }
+    if (args.shm && (args.mode == PM_MULTIFILE || args.mode == PM_ATLAS || args.modes || args.axes ||
+                     args.trim || args.dedup || args.apng || args.mipmaps || args.maxTextureSize ||
+                     args.scale > 1 || args.format != OF_PNG || args.bundle || args.tarFile || args.batch)) {
+        fputs("Error: --shm publishes a single sheet as it's rasterized, so it doesn't work with multifile, atlas,"
+              " --modes, --axes or options that change how the sheet is written\n", stderr);
+        exit(-1);
+    }
+    if (args.layout && (args.mode == PM_MULTIFILE || args.mode == PM_ATLAS || args.modes || args.axes ||
+                        args.dedup || args.apng || args.bundle || args.shm)) {
+        fputs("Error: --layout describes a single sheet, so it doesn't work with multifile, atlas,"
+              " --modes, --axes, --dedup, --apng, --bundle or --shm\n", stderr);
+        exit(-1);
+    }
+    if (args.batch && strcmp(args.outFile, "-") == 0) {
+        fputs("Error: --batch needs a directory to write to\n", stderr);
+        exit(-1);
+    }
+    /* Only a single file can be written to stdout, and not next to an archive */
+    if (strcmp(args.outFile, "-") == 0 && args.tarFile) {
+        fputs("Error: Use --tar - to write the archive to stdout\n", stderr);
+        exit(-1);
+    }
+    if (strcmp(args.outFile, "-") == 0 &&
+            (args.mode == PM_MULTIFILE || args.mode == PM_GAMEMAKER || args.mode == PM_PACKED || args.mode == PM_ATLAS ||
+             args.modes || args.axes || args.trim || args.dedup || args.maxTextureSize || args.layout ||
+             (args.mipmaps && args.format != OF_DDS))) {
+        fputs("Error: This writes more than one file, so it can't write to -\n", stderr);
+        exit(-1);
+    }
+    return args;
+}
+
+/* An RGBA image */
+typedef struct {
+    uint32_t width, height;
+    uint32_t *rgba;
+} Image;
+
+/* Frees the image data */
+void freeImage(Image img) {
+    free(img.rgba);
+}
+
+/* Fills a table with the RGBA value of every color index, so the
+   rasterizers don't have to do getColor's modulo for every voxel */
+void makeColorTable(const uint32_t *palette, uint32_t *table) {
+    for (int i = 0; i < 256; ++i) {
+        table[i] = getColor(palette, (uint8_t) i);
+    }
+}
+
+/* The box around the opaque pixels of a cell, relative to the cell, and
+   how many voxels were drawn into it. Everything is 0 for empty cells */
+typedef struct {
+    uint32_t x, y, width, height;
+    uint32_t numVoxels;
+} LayerBounds;
+
+/* Where a cell of a sheet is, and which layer of which keyframe it shows */
+typedef struct {
+    uint32_t x, y, width, height;
+    /* The Z layer, or the angle in PM_ROTATED */
+    uint32_t layer;
+    /* The keyframe */
+    uint32_t frame;
+    /* Filled in by the rasterizers as they go */
+    LayerBounds bounds;
+} SheetCell;
+
+/* Where all cells of a sheet are, and how big the sheet is */
+typedef struct {
+    SheetCell *cells;
+    uint32_t numCells;
+    uint32_t width, height;
+} SheetLayout;
+
+/* The voxels of a model, bucketed so that they can be written row by row */
+typedef struct {
+    /* The voxels ordered by z, then y */
+    const Voxel *voxels;
+    /* Index of the first voxel of every (z, y) row, row z * y + y,
+       followed by one extra entry holding the total amount of voxels */
+    uint32_t *rowStart;
+    /* Whether voxels was allocated by sortVoxels */
+    int ownsVoxels;
+} SortedVoxels;
+
+/* Counting sorts the voxels of a model by (z, y), so that the voxels of
+   every row of every layer end up next to each other. The sort is stable,
+   so voxels at the same position keep their order from the file and the
+   last one still wins. Files that are already in that order are used
+   in place */
+SortedVoxels sortVoxels(const SizeChunk *size, const VoxelChunk *voxelChunk) {
+    uint32_t numVoxels = voxelChunk->numVoxels;
+    uint32_t numRows = size->y * size->z;
+    const Voxel *voxels = getVoxels(voxelChunk);
+    uint32_t *rowStart = calloc(numRows + 1, sizeof(uint32_t));
+
+    /* Count the voxels in every row, and check if they're in order already */
+    int inOrder = 1;
+    uint32_t lastRow = 0;
+    for (uint32_t i = 0; i < numVoxels; ++i) {
+        uint32_t row = voxels[i].z * size->y + voxels[i].y;
+        rowStart[row + 1]++;
+        if (row < lastRow) inOrder = 0;
+        lastRow = row;
+    }
+    for (uint32_t row = 0; row < numRows; ++row) {
+        rowStart[row + 1] += rowStart[row];
+    }
+    if (inOrder) {
+        return (SortedVoxels) {
+            voxels, rowStart, 0
+        };
+    }
+
+    /* Scatter the voxels into their rows */
+    Voxel *sorted = malloc(sizeof(Voxel) * numVoxels);
+    for (uint32_t i = 0; i < numVoxels; ++i) {
+        uint32_t row = voxels[i].z * size->y + voxels[i].y;
+        sorted[rowStart[row]++] = voxels[i];
+    }
+    /* The scatter moved every start to the start of the next row */
+    memmove(rowStart + 1, rowStart, sizeof(uint32_t) * numRows);
+    rowStart[0] = 0;
+
+    return (SortedVoxels) {
+        sorted, rowStart, 1
+    };
+}
+
+/* Frees the arrays allocated by sortVoxels */
+void freeSortedVoxels(SortedVoxels sorted) {
+    if (sorted.ownsVoxels) free((Voxel *) sorted.voxels);
+    free(sorted.rowStart);
+}
+
+/* Writes the rows yBegin until yEnd of Z layer z of a sorted model into
+   the cell starting at cell, where the top left of the cell is voxel
+   (xBegin, yBegin). Runs of neighbouring voxels with the same color are
+   filled in one go. Returns the bounds of what it drew, which the compiler
+   drops again where they aren't used */
+static inline LayerBounds rasterizeLayerRect(const SortedVoxels *sorted, uint32_t ySize, uint32_t z,
+                                             uint32_t xBegin, uint32_t yBegin, uint32_t yEnd,
+                                             const uint32_t *colors, uint32_t *cell, size_t stride) {
+    uint32_t minX = UINT32_MAX, maxX = 0, minY = UINT32_MAX, maxY = 0, numVoxels = 0;
+    for (uint32_t y = yBegin; y < yEnd; ++y) {
+        uint32_t *row = cell + (y - yBegin) * stride;
+        uint32_t end = sorted->rowStart[z * ySize + y + 1];
+        uint32_t i = sorted->rowStart[z * ySize + y];
+        while (i < end) {
+            Voxel first = sorted->voxels[i];
+            uint32_t runEnd = i + 1;
+            while (runEnd < end &&
+                    sorted->voxels[runEnd].colorIndex == first.colorIndex &&
+                    sorted->voxels[runEnd].x == first.x + (runEnd - i)) {
+                runEnd++;
+            }
+            uint32_t color = colors[first.colorIndex];
+            uint32_t *span = row + (first.x - xBegin);
+            for (uint32_t j = 0; j < runEnd - i; ++j) {
+                span[j] = color;
+            }
+            if (color >> 24) {
+                if (first.x < minX) minX = first.x;
+                if (first.x + (runEnd - i) - 1 > maxX) maxX = first.x + (runEnd - i) - 1;
+                if (y < minY) minY = y;
+                maxY = y;
+                numVoxels += runEnd - i;
+            }
+            i = runEnd;
+        }
+    }
+    if (numVoxels == 0) return (LayerBounds) { 0, 0, 0, 0, 0 };
+    return (LayerBounds) {
+        minX - xBegin, minY - yBegin, maxX - minX + 1, maxY - minY + 1, numVoxels
+    };
+}
+
+/* Writes Z layer z of a sorted model into the cell starting at cell, and
+   its bounds into cell z of cells unless that's NULL */
+static inline void rasterizeLayer(const SortedVoxels *sorted, uint32_t ySize, uint32_t z,
+                                  const uint32_t *colors, uint32_t *cell, size_t stride, SheetCell *cells) {
+    if (cells) cells[z].bounds = rasterizeLayerRect(sorted, ySize, z, 0, 0, ySize, colors, cell, stride);
+    else rasterizeLayerRect(sorted, ySize, z, 0, 0, ySize, colors, cell, stride);
+}
+
+/* Rasterizes a model with its layers next to each other on the X axis.
+   cells gets the bounds of every layer when it isn't NULL, here and below */
+void rasterizeHorizontal(const SortedVoxels *sorted, const SizeChunk *size,
+                         const uint32_t *colors, uint32_t *sheet, size_t stride, SheetCell *cells) {
+    for (uint32_t z = 0; z < size->z; ++z) {
+        rasterizeLayer(sorted, size->y, z, colors, sheet + z * size->x, stride, cells);
+    }
+}
+
+/* Rasterizes a model with its layers next to each other on the Y axis */
+void rasterizeVertical(const SortedVoxels *sorted, const SizeChunk *size,
+                       const uint32_t *colors, uint32_t *sheet, size_t stride, SheetCell *cells) {
+    for (uint32_t z = 0; z < size->z; ++z) {
+        rasterizeLayer(sorted, size->y, z, colors, sheet + z * size->y * stride, stride, cells);
+    }
+}
+
+/* Rasterizes a model with its layers left to right and top to bottom
+   in rows of xCells layers */
+void rasterizeSquare(const SortedVoxels *sorted, const SizeChunk *size, uint32_t xCells,
+                     const uint32_t *colors, uint32_t *sheet, size_t stride, SheetCell *cells) {
+    uint32_t column = 0;
+    uint32_t *cellRow = sheet;
+    for (uint32_t z = 0; z < size->z; ++z) {
+        rasterizeLayer(sorted, size->y, z, colors, cellRow + column * size->x, stride, cells);
+        if (++column == xCells) {
+            column = 0;
+            cellRow += size->y * stride;
+        }
+    }
+}
+
+/* Frees the cells of a SheetLayout */
+void freeSheetLayout(SheetLayout layout) {
+    free(layout.cells);
+}
+
+/* Returns where makeAnimatedSheet or makeSheet put every layer of vox,
+   in the order of the keyframes and then the layers */
+SheetLayout makeSheetLayout(ParsedVox vox, PackingMode mode) {
+    uint32_t numFrames = mode == PM_ANIMATED ? vox.numModels : 1;
+    uint32_t numCells = 0;
+    for (uint32_t i = 0; i < numFrames; ++i) {
+        numCells += vox.sizeChunks[i]->z;
+    }
+    SheetLayout layout = { malloc(sizeof(SheetCell) * (numCells ? numCells : 1)), 0, 0, 0 };
+    for (uint32_t i = 0; i < numFrames; ++i) {
+        const SizeChunk *size = vox.sizeChunks[i];
+        uint32_t columns = mode == PM_VERTICAL ? 1 :
+                           mode == PM_SQUARE ? (uint32_t) ceil(sqrt(size->z)) : size->z;
+        uint32_t rows = mode == PM_SQUARE ? columns : mode == PM_VERTICAL ? size->z : 1;
+        for (uint32_t z = 0; z < size->z; ++z) {
+            layout.cells[layout.numCells++] = (SheetCell) {
+                z % columns * size->x, layout.height + z / columns * size->y, size->x, size->y, z, i,
+                { 0, 0, 0, 0, 0 }
+            };
+        }
+        if (columns * size->x > layout.width) layout.width = columns * size->x;
+        layout.height += rows * size->y;
+    }
+    return layout;
+}
+
+/* Makes a PM_ANIMATED sheet, and its layout when layout isn't NULL */
+Image makeAnimatedSheet(ParsedVox vox, SheetLayout *layout) {
+    /* Determine the size of the resulting sheet, and the Y offset of
+       every keyframe's band as a prefix sum over the keyframe heights */
+    uint32_t width = 0, height = 0, numCells = 0;
+    uint32_t *bandY = malloc(sizeof(uint32_t) * vox.numModels);
+    uint32_t *firstCell = malloc(sizeof(uint32_t) * vox.numModels);
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        const SizeChunk *size = vox.sizeChunks[i];
+        uint32_t thisWidth = size->x * size->z;
+        if (thisWidth > width) width = thisWidth;
+        bandY[i] = height;
+        height += size->y;
+        firstCell[i] = numCells;
+        numCells += size->z;
+    }
+    if (layout) *layout = makeSheetLayout(vox, PM_ANIMATED);
+    /* Allocate the image data */
+    uint32_t *rgba = calloc((size_t) width * height, sizeof(uint32_t));
+    uint32_t colors[256];
+    makeColorTable(vox.palette, colors);
+
+    /* Every keyframe writes into its own band of rows, so they can be
+       rasterized concurrently without any synchronization */
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) vox.numModels; ++i) {
+        SortedVoxels sorted = sortVoxels(vox.sizeChunks[i], vox.voxelChunks[i]);
+        rasterizeHorizontal(&sorted, vox.sizeChunks[i], colors, rgba + (size_t) bandY[i] * width, width,
+                            layout ? layout->cells + firstCell[i] : NULL);
+        freeSortedVoxels(sorted);
+    }
+
+    free(bandY);
+    free(firstCell);
+    return (Image) {
+        width, height,
+        rgba
+    };
+}
+
+/* Which cell of a deduplicated animated sheet every layer of every keyframe uses */
+typedef struct {
+    uint32_t numFrames, numLayers;
+    /* The size of a cell, and the number of cells on the X axis of the sheet */
+    uint32_t cellWidth, cellHeight, columns;
+    /* The number of unique cells */
+    uint32_t numCells;
+    /* The cell index of layer z of keyframe f, at f * numLayers + z */
+    uint32_t *cells;
+} FrameTable;
+
+/* Frees the cell indices of a FrameTable */
+void freeFrameTable(FrameTable table) {
+    free(table.cells);
+}
+
+/* Returns the FNV-1a hash of a cell */
+static uint64_t hashCell(const uint32_t *cell, size_t numPixels) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < numPixels; ++i) {
+        hash = (hash ^ cell[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Makes a PM_ANIMATED sheet in which every unique cell is stored once,
+   table receives the cell that every layer of every keyframe uses */
+Image makeDedupedAnimatedSheet(ParsedVox vox, FrameTable *table) {
+    /* Every cell gets the size of the biggest keyframe */
+    uint32_t cellWidth = 1, cellHeight = 1, numLayers = 1;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        const SizeChunk *size = vox.sizeChunks[i];
+        if (size->x > cellWidth) cellWidth = size->x;
+        if (size->y > cellHeight) cellHeight = size->y;
+        if (size->z > numLayers) numLayers = size->z;
+    }
+    size_t cellPixels = (size_t) cellWidth * cellHeight;
+    size_t numSlices = (size_t) vox.numModels * numLayers;
+    uint32_t *slices = calloc(numSlices * cellPixels, sizeof(uint32_t));
+    uint64_t *hashes = malloc(sizeof(uint64_t) * numSlices);
+    uint32_t colors[256];
+    makeColorTable(vox.palette, colors);
+
+    /* Rasterize and hash every layer of every keyframe */
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) vox.numModels; ++i) {
+        const SizeChunk *size = vox.sizeChunks[i];
+        uint32_t *frame = slices + (size_t) i * numLayers * cellPixels;
+        SortedVoxels sorted = sortVoxels(size, vox.voxelChunks[i]);
+        for (uint32_t z = 0; z < numLayers; ++z) {
+            uint32_t *slice = frame + z * cellPixels;
+            if (z < size->z) rasterizeLayer(&sorted, size->y, z, colors, slice, cellWidth, NULL);
+            hashes[(size_t) i * numLayers + z] = hashCell(slice, cellPixels);
+        }
+        freeSortedVoxels(sorted);
+    }
+
+    /* Find the unique cells with an open addressing hash table of cell indices */
+    size_t tableSize = 16;
+    while (tableSize < numSlices * 2) tableSize *= 2;
+    uint32_t *buckets = malloc(sizeof(uint32_t) * tableSize);
+    memset(buckets, 0xFF, sizeof(uint32_t) * tableSize);
+    uint32_t *cells = malloc(sizeof(uint32_t) * numSlices);
+    size_t *uniqueSlices = malloc(sizeof(size_t) * numSlices);
+    uint32_t numCells = 0;
+    for (size_t i = 0; i < numSlices; ++i) {
+        size_t bucket = hashes[i] & (tableSize - 1);
+        for (;;) {
+            uint32_t cell = buckets[bucket];
+            if (cell == UINT32_MAX) {
+                buckets[bucket] = numCells;
+                uniqueSlices[numCells] = i;
+                cells[i] = numCells++;
+                break;
+            }
+            size_t other = uniqueSlices[cell];
+            if (hashes[other] == hashes[i] &&
+                    memcmp(slices + other * cellPixels, slices + i * cellPixels,
+                           cellPixels * sizeof(uint32_t)) == 0) {
+                cells[i] = cell;
+                break;
+            }
+            bucket = (bucket + 1) & (tableSize - 1);
+        }
+    }
+
+    /* Lay the unique cells out left to right and top to bottom */
+    uint32_t columns = (uint32_t) ceil(sqrt(numCells));
+    uint32_t rows = (numCells + columns - 1) / columns;
+    uint32_t width = columns * cellWidth, height = rows * cellHeight;
+    uint32_t *data = calloc((size_t) width * height, sizeof(uint32_t));
+    #pragma omp parallel for
+    for (int i = 0; i < (int) numCells; ++i) {
+        const uint32_t *slice = slices + uniqueSlices[i] * cellPixels;
+        uint32_t *cell = data + (size_t) (i / columns) * cellHeight * width + (i % columns) * cellWidth;
+        for (uint32_t y = 0; y < cellHeight; ++y) {
+            memcpy(cell + (size_t) y * width, slice + y * cellWidth, cellWidth * sizeof(uint32_t));
+        }
+    }
+    printInfo("Stored %u unique cells out of %u\n", numCells, (uint32_t) numSlices);
+
+    free(buckets);
+    free(uniqueSlices);
+    free(hashes);
+    free(slices);
+    *table = (FrameTable) {
+        vox.numModels, numLayers, cellWidth, cellHeight, columns, numCells, cells
+    };
+    return (Image) {
+        width, height,
+        data
+    };
+}
+
+/* Makes one image per keyframe, all with the size of the biggest keyframe */
+Image *makeAnimationFrames(ParsedVox vox) {
+    uint32_t width = 0, height = 0;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        const SizeChunk *size = vox.sizeChunks[i];
+        if (size->x * size->z > width) width = size->x * size->z;
+        if (size->y > height) height = size->y;
+    }
+    uint32_t colors[256];
+    makeColorTable(vox.palette, colors);
+
+    Image *frames = malloc(sizeof(Image) * vox.numModels);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) vox.numModels; ++i) {
+        uint32_t *rgba = calloc((size_t) width * height, sizeof(uint32_t));
+        SortedVoxels sorted = sortVoxels(vox.sizeChunks[i], vox.voxelChunks[i]);
+        rasterizeHorizontal(&sorted, vox.sizeChunks[i], colors, rgba, width, NULL);
+        freeSortedVoxels(sorted);
+        frames[i] = (Image) {
+            width, height,
+            rgba
+        };
+    }
+    return frames;
+}
+
+/* Makes the other sheets, and their layout when layout isn't NULL */
+Image makeSheet(ParsedVox vox, PackingMode mode, SheetLayout *layout) {
+    const SizeChunk *size = vox.sizeChunks[0];
+    uint32_t colors[256];
+    makeColorTable(vox.palette, colors);
+    SortedVoxels sorted = sortVoxels(size, vox.voxelChunks[0]);
+    if (layout) *layout = makeSheetLayout(vox, mode);
+    SheetCell *cells = layout ? layout->cells : NULL;
+
+    uint32_t width, height;
+    uint32_t *data;
+    if (mode == PM_HORIZONTAL || mode == PM_GAMEMAKER) {
+        width = size->x * size->z;
+        height = size->y;
+        data = calloc((size_t) width * height, sizeof(uint32_t));
+        rasterizeHorizontal(&sorted, size, colors, data, width, cells);
+    }
+    else if (mode == PM_VERTICAL || mode == PM_MULTIFILE) {
+        width = size->x;
+        height = size->y * size->z;
+        data = calloc((size_t) width * height, sizeof(uint32_t));
+        rasterizeVertical(&sorted, size, colors, data, width, cells);
+    }
+    else {
+        uint32_t squareCells = (uint32_t) ceil(sqrt(size->z));
+        width = size->x * squareCells;
+        height = size->y * squareCells;
+        data = calloc((size_t) width * height, sizeof(uint32_t));
+        rasterizeSquare(&sorted, size, squareCells, colors, data, width, cells);
+    }
+
+    freeSortedVoxels(sorted);
+    return (Image) {
+        width, height,
+        data
+    };
+}
+
+/* The sheets of slices along every axis of a model */
+typedef struct {
+    /* Only the sheets of the requested axes are made, the others are empty */
+    Image sheets[AX_SIZE];
+    uint32_t cellWidth[AX_SIZE], cellHeight[AX_SIZE];
+} SliceSheets;
+
+/* Makes a sheet of slices along every axis in the SliceAxis bits of axes,
+   laid out like makeSheet does for mode. Slices along X and Y have Z going
+   up. All sheets are filled in a single pass over the voxels. The cells
+   are sized with alignCellSize */
+SliceSheets makeSliceSheets(ParsedVox vox, PackingMode mode, uint32_t axes, uint32_t align) {
+    const SizeChunk *size = vox.sizeChunks[0];
+    uint32_t colors[256];
+    makeColorTable(vox.palette, colors);
+
+    SliceSheets slices;
+    memset(&slices, 0, sizeof(slices));
+    uint32_t columns[AX_SIZE] = { 0 };
+    for (int axis = 0; axis < AX_SIZE; ++axis) {
+        if (!(axes & (1u << axis))) continue;
+        /* The size of a slice, and how many slices there are */
+        uint32_t width = axis == AX_X ? size->y : size->x;
+        uint32_t height = axis == AX_Z ? size->y : size->z;
+        uint32_t numCells = axis == AX_X ? size->x : axis == AX_Y ? size->y : size->z;
+        width = alignCellSize(width, align);
+        height = alignCellSize(height, align);
+        uint32_t rows;
+        if (mode == PM_HORIZONTAL) {
+            columns[axis] = numCells;
+            rows = 1;
+        }
+        else if (mode == PM_VERTICAL) {
+            columns[axis] = 1;
+            rows = numCells;
+        }
+        else {
+            columns[axis] = rows = (uint32_t) ceil(sqrt(numCells));
+        }
+        slices.cellWidth[axis] = width;
+        slices.cellHeight[axis] = height;
+        slices.sheets[axis].width = width * columns[axis];
+        slices.sheets[axis].height = height * rows;
+        slices.sheets[axis].rgba = calloc((size_t) slices.sheets[axis].width * slices.sheets[axis].height,
+                                          sizeof(uint32_t));
+    }
+
+    /* Scatter every voxel into every sheet. The cell is the coordinate
+       along the axis, the other two are the position in the cell */
+    const VoxelChunk *voxelChunk = vox.voxelChunks[0];
+    const Voxel *voxels = getVoxels(voxelChunk);
+    for (uint32_t i = 0; i < voxelChunk->numVoxels; ++i) {
+        Voxel v = voxels[i];
+        uint32_t color = colors[v.colorIndex];
+        uint32_t top = size->z - 1 - v.z;
+        uint32_t cells[AX_SIZE] = { v.x, v.y, v.z };
+        uint32_t xs[AX_SIZE] = { v.y, v.x, v.x };
+        uint32_t ys[AX_SIZE] = { top, top, v.y };
+        for (int axis = 0; axis < AX_SIZE; ++axis) {
+            if (!columns[axis]) continue;
+            Image sheet = slices.sheets[axis];
+            uint32_t cellX = cells[axis] % columns[axis] * slices.cellWidth[axis];
+            uint32_t cellY = cells[axis] / columns[axis] * slices.cellHeight[axis];
+            sheet.rgba[(size_t) (cellY + ys[axis]) * sheet.width + cellX + xs[axis]] = color;
+        }
+    }
+    return slices;
+}
+
+/* Composites the stacked layers of a model, rasterized under each other
+   in layers, into a cell of a rotated sheet. The model is turned by angle
+   radians clockwise around its center, its layers are scaled by squash on
+   the Y axis, and every layer is drawn one pixel above the one below it.
+   The center of the bottom layer ends up at (centerX, centerY). Returns
+   the box around the drawn pixels */
+static LayerBounds compositeRotated(const uint32_t *layers, const SizeChunk *size, double angle, double squash,
+                                    double centerX, double centerY, uint32_t *cell, uint32_t cellWidth,
+                                    uint32_t cellHeight, size_t stride) {
+    double c = cos(angle), s = sin(angle);
+    /* The extent of a turned layer around its center */
+    double halfWidth = (fabs(c) * size->x + fabs(s) * size->y) / 2;
+    double halfHeight = (fabs(s) * size->x + fabs(c) * size->y) / 2 * squash;
+    int xBegin = (int) floor(centerX - halfWidth), xEnd = (int) ceil(centerX + halfWidth);
+    if (xBegin < 0) xBegin = 0;
+    if (xEnd > (int) cellWidth) xEnd = cellWidth;
+
+    int minX = INT_MAX, maxX = -1, minY = INT_MAX, maxY = -1;
+    for (uint32_t z = 0; z < size->z; ++z) {
+        const uint32_t *layer = layers + (size_t) z * size->x * size->y;
+        double layerY = centerY - z;
+        int yBegin = (int) floor(layerY - halfHeight), yEnd = (int) ceil(layerY + halfHeight);
+        if (yBegin < 0) yBegin = 0;
+        if (yEnd > (int) cellHeight) yEnd = cellHeight;
+        for (int y = yBegin; y < yEnd; ++y) {
+            /* Turn the center of every pixel back into the layer, the
+               position in the layer moves by (c, -s) per pixel */
+            double dy = (y + 0.5 - layerY) / squash;
+            double dx = xBegin + 0.5 - centerX;
+            double sourceX = c * dx + s * dy + size->x / 2.0;
+            double sourceY = -s * dx + c * dy + size->y / 2.0;
+            uint32_t *row = cell + y * stride;
+            for (int x = xBegin; x < xEnd; ++x, sourceX += c, sourceY -= s) {
+                if (sourceX < 0 || sourceY < 0 || sourceX >= size->x || sourceY >= size->y) continue;
+                uint32_t color = layer[(uint32_t) sourceY * size->x + (uint32_t) sourceX];
+                if (!(color >> 24)) continue;
+                row[x] = color;
+                if (x < minX) minX = x;
+                if (x > maxX) maxX = x;
+                if (y < minY) minY = y;
+                if (y > maxY) maxY = y;
+            }
+        }
+    }
+    if (maxX < 0) return (LayerBounds) { 0, 0, 0, 0, 0 };
+    return (LayerBounds) {
+        (uint32_t) minX, (uint32_t) minY, (uint32_t) (maxX - minX + 1), (uint32_t) (maxY - minY + 1), 0
+    };
+}
+
+/* Makes a PM_ROTATED sheet with numAngles cells per keyframe, and its
+   layout when layout isn't NULL. The cells are sized with alignCellSize */
+Image makeRotatedSheet(ParsedVox vox, uint32_t numAngles, double squash, uint32_t align,
+                       uint32_t *outCellWidth, uint32_t *outCellHeight, SheetLayout *layout) {
+    /* A cell fits the diagonal of every keyframe at every angle, plus
+       the height of the stack */
+    double diagonal = 0;
+    uint32_t maxZ = 0;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        const SizeChunk *size = vox.sizeChunks[i];
+        double thisDiagonal = sqrt((double) size->x * size->x + (double) size->y * size->y);
+        if (thisDiagonal > diagonal) diagonal = thisDiagonal;
+        if (size->z > maxZ) maxZ = size->z;
+    }
+    uint32_t cellWidth = (uint32_t) ceil(diagonal);
+    uint32_t cellHeight = (uint32_t) ceil(diagonal * squash) + maxZ - 1;
+    cellWidth = alignCellSize(cellWidth, align);
+    cellHeight = alignCellSize(cellHeight, align);
+    uint32_t width = cellWidth * numAngles;
+    uint32_t height = cellHeight * vox.numModels;
+    uint32_t *rgba = calloc((size_t) width * height, sizeof(uint32_t));
+    uint32_t colors[256];
+    makeColorTable(vox.palette, colors);
+
+    /* Rasterize the layers of every keyframe once, under each other */
+    uint32_t **layers = malloc(sizeof(uint32_t *) * vox.numModels);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) vox.numModels; ++i) {
+        const SizeChunk *size = vox.sizeChunks[i];
+        layers[i] = calloc((size_t) size->x * size->y * size->z, sizeof(uint32_t));
+        SortedVoxels sorted = sortVoxels(size, vox.voxelChunks[i]);
+        rasterizeVertical(&sorted, size, colors, layers[i], size->x, NULL);
+        freeSortedVoxels(sorted);
+    }
+
+    /* Every cell is composited on its own, so they can all be done at once */
+    double fullTurn = 2 * acos(-1.0);
+    int numCells = (int) (numAngles * vox.numModels);
+    if (layout) *layout = (SheetLayout) { malloc(sizeof(SheetCell) * numCells), (uint32_t) numCells, width, height };
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < numCells; ++i) {
+        uint32_t model = i / numAngles, angle = i % numAngles;
+        uint32_t *cell = rgba + (size_t) model * cellHeight * width + angle * cellWidth;
+        LayerBounds bounds = compositeRotated(layers[model], vox.sizeChunks[model], fullTurn * angle / numAngles,
+                                              squash, cellWidth / 2.0, cellHeight - ceil(diagonal * squash) / 2.0,
+                                              cell, cellWidth, cellHeight, width);
+        if (!layout) continue;
+        /* A turned cell shows all voxels of the keyframe */
+        bounds.numVoxels = vox.voxelChunks[model]->numVoxels;
+        layout->cells[i] = (SheetCell) {
+            angle * cellWidth, model * cellHeight, cellWidth, cellHeight, angle, model, bounds
+        };
+    }
+
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        free(layers[i]);
+    }
+    free(layers);
+    *outCellWidth = cellWidth;
+    *outCellHeight = cellHeight;
+    return (Image) {
+        width, height,
+        rgba
+    };
+}
+
+/* The header at the start of a stacked sprite bundle. A bundle is meant to
+   be mapped into memory and used as is, so everything in it is a little
+   endian 32 bit number or a byte array that's padded to 4 bytes, whatever
+   machine wrote it, and all offsets are from the start of the file */
+typedef struct {
+    /* "VSSB" */
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numModels;
+    /* 256 RGBA colors, indexed by the palette indices of the spans */
+    uint32_t paletteOffset;
+    /* numModels BundleModels */
+    uint32_t modelsOffset;
+} BundleHeader;
+
+/* A model in a stacked sprite bundle */
+typedef struct {
+    uint32_t x, y, z;
+    /* z + 1 offsets of BundleLayers, the last one is the end of the
+       last layer, so the size of layer i is offset i + 1 minus offset i */
+    uint32_t layersOffset;
+} BundleModel;
+
+/* A layer in a stacked sprite bundle. It's followed by numSpans
+   BundleSpans, and then by the palette indices of all spans */
+typedef struct {
+    uint32_t numSpans;
+} BundleLayer;
+
+/* A horizontal run of opaque pixels in a layer */
+typedef struct {
+    uint8_t x, y, length, reserved;
+    /* The index of the first palette index of the span, counting from
+       the first palette index of the layer */
+    uint32_t firstIndex;
+} BundleSpan;
+
+/* Appends the layers of a model to buffer, and stores where every layer
+   starts relative to the start of the buffer in layerStarts */
+static void appendBundleLayers(ByteBuffer *buffer, const SizeChunk *size, const VoxelChunk *voxelChunk,
+                               uint32_t *layerStarts) {
+    SortedVoxels sorted = sortVoxels(size, voxelChunk);
+    BundleSpan *spans = malloc(sizeof(BundleSpan) * (size->x / 2 + 1) * size->y);
+    uint8_t *indices = malloc((size_t) size->x * size->y + 4);
+    for (uint32_t z = 0; z < size->z; ++z) {
+        uint32_t numSpans = 0, numIndices = 0;
+        for (uint32_t y = 0; y < size->y; ++y) {
+            /* Put the row in order, the last voxel at a position wins */
+            uint8_t row[256] = { 0 };
+            uint32_t end = sorted.rowStart[z * size->y + y + 1];
+            for (uint32_t i = sorted.rowStart[z * size->y + y]; i < end; ++i) {
+                row[sorted.voxels[i].x] = sorted.voxels[i].colorIndex;
+            }
+            for (uint32_t x = 0; x < size->x; ++x) {
+                if (row[x] == 0) continue;
+                BundleSpan span = { (uint8_t) x, (uint8_t) y, 0, 0, numIndices };
+                while (x < size->x && row[x] != 0 && span.length < 255) {
+                    indices[numIndices++] = row[x++];
+                    span.length++;
+                }
+                x--;
+                spans[numSpans++] = span;
+            }
+        }
+        layerStarts[z] = (uint32_t) appendLittleEndian(buffer, numSpans);
+        for (uint32_t i = 0; i < numSpans; ++i) {
+            const BundleSpan *span = &spans[i];
+            uint8_t position[4] = { span->x, span->y, span->length, span->reserved };
+            appendBytes(buffer, position, sizeof(position));
+            appendLittleEndian(buffer, span->firstIndex);
+        }
+        appendBytes(buffer, indices, numIndices);
+        appendBytes(buffer, NULL, (4 - numIndices % 4) % 4);
+    }
+    layerStarts[size->z] = (uint32_t) buffer->length;
+    free(indices);
+    free(spans);
+    freeSortedVoxels(sorted);
+}
+
+/* Writes the models straight from their voxels as a stacked sprite bundle */
+void writeBundle(ParsedVox vox, const char *path) {
+    /* Make the layers of every model in parallel, each in its own buffer */
+    ByteBuffer *layers = calloc(vox.numModels, sizeof(ByteBuffer));
+    uint32_t **layerStarts = malloc(sizeof(uint32_t *) * vox.numModels);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) vox.numModels; ++i) {
+        layerStarts[i] = malloc(sizeof(uint32_t) * (vox.sizeChunks[i]->z + 1));
+        appendBundleLayers(&layers[i], vox.sizeChunks[i], vox.voxelChunks[i], layerStarts[i]);
+    }
+
+    /* Lay out the header, palette, models and layer tables, then the layers */
+    uint32_t paletteOffset = sizeof(BundleHeader);
+    uint32_t modelsOffset = paletteOffset + 256 * sizeof(uint32_t);
+    size_t offset = modelsOffset + sizeof(BundleModel) * vox.numModels;
+    size_t layersStart = offset;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        offset += sizeof(uint32_t) * (vox.sizeChunks[i]->z + 1);
+    }
+    size_t tablesEnd = offset;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        offset += layers[i].length;
+    }
+    if (offset > UINT32_MAX) {
+        fputs("Error: The bundle is too big\n", stderr);
+        exit(-1);
+    }
+
+    /* Everything in front of the layers is written field by field as little
+       endian, the colors are RGBA bytes already */
+    ByteBuffer head = { 0 };
+    uint32_t header[] = { 0x42535356, 1, vox.numModels, paletteOffset, modelsOffset };
+    for (size_t i = 0; i < sizeof(header) / sizeof(header[0]); ++i) {
+        appendLittleEndian(&head, header[i]);
+    }
+    uint32_t colors[256];
+    makeColorTable(vox.palette, colors);
+    colors[0] = 0;
+    appendBytes(&head, colors, sizeof(colors));
+    offset = layersStart;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        const SizeChunk *size = vox.sizeChunks[i];
+        appendLittleEndian(&head, size->x);
+        appendLittleEndian(&head, size->y);
+        appendLittleEndian(&head, size->z);
+        appendLittleEndian(&head, (uint32_t) offset);
+        offset += sizeof(uint32_t) * (size->z + 1);
+    }
+    offset = tablesEnd;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        for (uint32_t z = 0; z <= vox.sizeChunks[i]->z; ++z) {
+            appendLittleEndian(&head, layerStarts[i][z] + (uint32_t) offset);
+        }
+        offset += layers[i].length;
+    }
+    FILE *handle = openOutput(path);
+    int ok = handle != NULL;
+    ok = ok && fwrite(head.data, 1, head.length, handle) == head.length;
+    for (uint32_t i = 0; ok && i < vox.numModels; ++i) {
+        ok = fwrite(layers[i].data, 1, layers[i].length, handle) == layers[i].length;
+    }
+    if (handle) ok = closeOutput(handle, path) && ok;
+    if (!ok) {
+        fputs("Error: Failed to write bundle file\n", stderr);
+    }
+
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        free(layers[i].data);
+        free(layerStarts[i]);
+    }
+    free(layers);
+    free(layerStarts);
+    free(head.data);
+}
+
+/* A segment of the skyline of a Skyline packer */
+typedef struct {
+    uint32_t x, y, width;
+} SkylineNode;
+
+/* A bottom-left skyline rectangle packer */
+typedef struct {
+    /* The size of the area that is packed into */
+    uint32_t width, height;
+    /* The segments of the skyline from left to right */
+    uint32_t numNodes, maxNodes;
+    SkylineNode *nodes;
+} Skyline;
+
+/* Starts packing into an empty area of width by height pixels */
+Skyline makeSkyline(uint32_t width, uint32_t height) {
+    Skyline skyline = { width, height, 1, 16, malloc(sizeof(SkylineNode) * 16) };
+    skyline.nodes[0] = (SkylineNode) { 0, 0, width };
+    return skyline;
+}
+
+/* Frees the nodes of a Skyline */
+void freeSkyline(Skyline skyline) {
+    free(skyline.nodes);
+}
+
+/* Finds the lowest spot for a width by height rectangle and reserves it.
+   Returns 0 when the rectangle doesn't fit anywhere */
+int skylinePack(Skyline *skyline, uint32_t width, uint32_t height, uint32_t *outX, uint32_t *outY) {
+    uint32_t bestY = UINT32_MAX, bestNode = 0;
+    for (uint32_t i = 0; i < skyline->numNodes; ++i) {
+        uint32_t x = skyline->nodes[i].x;
+        if (x + width > skyline->width) break;
+        /* The rectangle rests on the highest node it spans */
+        uint32_t y = 0, covered = 0;
+        for (uint32_t j = i; covered < width; ++j) {
+            if (skyline->nodes[j].y > y) y = skyline->nodes[j].y;
+            covered += skyline->nodes[j].width;
+        }
+        if (y + height <= skyline->height && y < bestY) {
+            bestY = y;
+            bestNode = i;
+        }
+    }
+    if (bestY == UINT32_MAX) return 0;
+
+    /* Replace the nodes under the rectangle with a single new node */
+    uint32_t x = skyline->nodes[bestNode].x;
+    uint32_t end = bestNode;
+    while (end < skyline->numNodes && skyline->nodes[end].x + skyline->nodes[end].width <= x + width) end++;
+    SkylineNode rest = { 0, 0, 0 };
+    int hasRest = end < skyline->numNodes && skyline->nodes[end].x < x + width;
+    if (hasRest) {
+        rest = skyline->nodes[end];
+        rest.width -= x + width - rest.x;
+        rest.x = x + width;
+        end++;
+    }
+    uint32_t numNew = hasRest ? 2 : 1;
+    if (skyline->numNodes - (end - bestNode) + numNew > skyline->maxNodes) {
+        skyline->maxNodes = skyline->maxNodes * 2 + numNew;
+        skyline->nodes = realloc(skyline->nodes, sizeof(SkylineNode) * skyline->maxNodes);
+    }
+    memmove(&skyline->nodes[bestNode + numNew], &skyline->nodes[end],
+            sizeof(SkylineNode) * (skyline->numNodes - end));
+    skyline->numNodes = skyline->numNodes - (end - bestNode) + numNew;
+    skyline->nodes[bestNode] = (SkylineNode) { x, bestY + height, width };
+    if (hasRest) skyline->nodes[bestNode + 1] = rest;
+
+    *outX = x;
+    *outY = bestY;
+    return 1;
+}
+
+/* Where a layer ended up in a PM_PACKED sheet */
+typedef struct {
+    /* The rectangle in the sheet, empty for layers without voxels */
+    uint32_t x, y, width, height;
+    /* The position of the top left of the rectangle in the layer */
+    uint32_t offsetX, offsetY;
+} PackedLayer;
+
+/* Sorts layer indices from the tallest to the shortest layer */
+static const PackedLayer *sortingLayers;
+static int compareLayerHeight(const void *a, const void *b) {
+    const PackedLayer *layerA = &sortingLayers[*(const uint32_t *) a];
+    const PackedLayer *layerB = &sortingLayers[*(const uint32_t *) b];
+    if (layerA->height != layerB->height) return layerA->height < layerB->height ? 1 : -1;
+    if (layerA->width != layerB->width) return layerA->width < layerB->width ? 1 : -1;
+    return *(const uint32_t *) a < *(const uint32_t *) b ? -1 : 1;
+}
+
+/* Packs the rectangles of the layers into a sheet that is width pixels
+   wide, and returns the height of the sheet */
+uint32_t packLayers(PackedLayer *layers, const uint32_t *order, uint32_t numLayers, uint32_t width) {
+    Skyline skyline = makeSkyline(width, UINT32_MAX);
+    uint32_t height = 0;
+    for (uint32_t i = 0; i < numLayers; ++i) {
+        PackedLayer *layer = &layers[order[i]];
+        if (layer->width == 0) continue;
+        skylinePack(&skyline, layer->width, layer->height, &layer->x, &layer->y);
+        if (layer->y + layer->height > height) height = layer->y + layer->height;
+    }
+    freeSkyline(skyline);
+    return height;
+}
+
+/* Finds the box around the voxels of every Z layer of a model, and stores
+   it as the width, height and offset of the layer's rectangle */
+void findLayerRects(const SizeChunk *size, const VoxelChunk *voxelChunk, PackedLayer *layers) {
+    const Voxel *voxels = getVoxels(voxelChunk);
+    uint32_t minX[256], minY[256], maxX[256], maxY[256];
+    for (uint32_t z = 0; z < size->z; ++z) {
+        minX[z] = minY[z] = 255;
+        maxX[z] = maxY[z] = 0;
+        layers[z] = (PackedLayer) { 0, 0, 0, 0, 0, 0 };
+    }
+    for (uint32_t i = 0; i < voxelChunk->numVoxels; ++i) {
+        Voxel v = voxels[i];
+        if (v.x < minX[v.z]) minX[v.z] = v.x;
+        if (v.y < minY[v.z]) minY[v.z] = v.y;
+        if (v.x > maxX[v.z]) maxX[v.z] = v.x;
+        if (v.y > maxY[v.z]) maxY[v.z] = v.y;
+    }
+    for (uint32_t z = 0; z < size->z; ++z) {
+        if (minX[z] > maxX[z]) continue;
+        layers[z].width = maxX[z] - minX[z] + 1;
+        layers[z].height = maxY[z] - minY[z] + 1;
+        layers[z].offsetX = minX[z];
+        layers[z].offsetY = minY[z];
+    }
+}
+
+/* Makes a PM_PACKED sheet, layers receives a rectangle for every Z layer.
+   The layout is made as well when layout isn't NULL */
+Image makePackedSheet(ParsedVox vox, PackedLayer *layers, SheetLayout *layout) {
+    if (vox.numModels > 1) {
+        fprintf(stderr, "Error: Packed mode packs the layers of a single model, but this file has %u models."
+                " Use atlas mode for more\n", vox.numModels);
+        exit(-1);
+    }
+    const SizeChunk *size = vox.sizeChunks[0];
+    const VoxelChunk *voxelChunk = vox.voxelChunks[0];
+
+    findLayerRects(size, voxelChunk, layers);
+    uint64_t area = 0;
+    uint32_t widest = 1;
+    uint32_t order[256];
+    for (uint32_t z = 0; z < size->z; ++z) {
+        order[z] = z;
+        area += layers[z].width * layers[z].height;
+        if (layers[z].width > widest) widest = layers[z].width;
+    }
+    sortingLayers = layers;
+    qsort(order, size->z, sizeof(uint32_t), compareLayerHeight);
+
+    /* Try a few sheet widths around the square root of the area and keep
+       the one that wastes the least space */
+    uint32_t squareWidth = (uint32_t) ceil(sqrt((double) area));
+    const double factors[] = { 0.75, 1.0, 1.25, 1.5, 2.0 };
+    uint32_t width = 0, height = 0;
+    for (size_t i = 0; i < sizeof(factors) / sizeof(factors[0]); ++i) {
+        uint32_t tryWidth = (uint32_t) (squareWidth * factors[i]);
+        if (tryWidth < widest) tryWidth = widest;
+        uint32_t tryHeight = packLayers(layers, order, size->z, tryWidth);
+        if (width == 0 || (uint64_t) tryWidth * tryHeight < (uint64_t) width * height) {
+            width = tryWidth;
+            height = tryHeight;
+        }
+    }
+    packLayers(layers, order, size->z, width);
+    if (height == 0) height = 1;
+
+    uint32_t colors[256];
+    makeColorTable(vox.palette, colors);
+    SortedVoxels sorted = sortVoxels(size, voxelChunk);
+    uint32_t *data = calloc((size_t) width * height, sizeof(uint32_t));
+    if (layout) *layout = (SheetLayout) { calloc(size->z ? size->z : 1, sizeof(SheetCell)), size->z, width, height };
+    for (uint32_t z = 0; z < size->z; ++z) {
+        const PackedLayer *layer = &layers[z];
+        if (layout) {
+            layout->cells[z] = (SheetCell) { layer->x, layer->y, layer->width, layer->height, z, 0, { 0, 0, 0, 0, 0 } };
+        }
+        if (layer->width == 0) continue;
+        LayerBounds bounds = rasterizeLayerRect(&sorted, size->y, z, layer->offsetX, layer->offsetY,
+                                                layer->offsetY + layer->height, colors,
+                                                data + (size_t) layer->y * width + layer->x, width);
+        if (layout) layout->cells[z].bounds = bounds;
+    }
+    freeSortedVoxels(sorted);
+
+    return (Image) {
+        width, height,
+        data
+    };
+}
+
+/* Writes where every layer of a PM_PACKED sheet ended up */
+void writePackedLayers(const PackedLayer *layers, uint32_t numLayers, const char *path) {
+    FILE *handle = openOutput(path);
+    if (!handle) {
+        fputs("Error: Failed to write layer file\n", stderr);
+        return;
+    }
+    fprintf(handle, "layers %u\n", numLayers);
+    for (uint32_t z = 0; z < numLayers; ++z) {
+        const PackedLayer *layer = &layers[z];
+        fprintf(handle, "%u %u %u %u %u %u %u\n", z, layer->x, layer->y,
+                layer->width, layer->height, layer->offsetX, layer->offsetY);
+    }
+    closeOutput(handle, path);
+}
+
+
+/* A rectangle of pixels */
+typedef struct {
+    uint32_t x, y, width, height;
+} Rect;
+
+/* The CRC-32 of every byte, filled by makeCrcTable */
+static uint32_t crcTable[256];
+
+/* Fills crcTable. This is done once at startup, before any threads that
+   write pngs can be running */
+void makeCrcTable(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crcTable[i] = c;
+    }
+}
+
+/* Updates a running CRC-32, start with 0 */
+uint32_t updateCrc(uint32_t crc, const unsigned char *data, size_t length) {
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i) {
+        crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* Updates a running Adler-32, start with 1 */
+uint32_t updateAdler(uint32_t adler, const unsigned char *data, size_t length) {
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (length > 0) {
+        /* 5552 bytes is the most that can be summed before b overflows */
+        size_t block = length < 5552 ? length : 5552;
+        size_t i = 0;
+        /* Sum 16 bytes at a time, b grows by a for each of them plus
+           every byte weighted by how many bytes of the group follow it */
+        for (; i + 16 <= block; i += 16) {
+            uint32_t sum = 0, weighted = 0;
+            for (int j = 0; j < 16; ++j) {
+                sum += data[i + j];
+                weighted += (16 - j) * data[i + j];
+            }
+            b += 16 * a + weighted;
+            a += sum;
+        }
+        for (; i < block; ++i) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += block;
+        length -= block;
+    }
+    return b << 16 | a;
+}
+
+/* Stores a 32 bit big endian number */
+static void putBigEndian(unsigned char *out, uint32_t value) {
+    out[0] = (unsigned char) (value >> 24);
+    out[1] = (unsigned char) (value >> 16);
+    out[2] = (unsigned char) (value >> 8);
+    out[3] = (unsigned char) value;
+}
+
+/* Writes a png chunk, an optional 4 byte prefix (like a sequence number)
+   is written in front of the data */
+void writePngChunk(FILE *handle, const char *type, const unsigned char *prefix,
+                   const unsigned char *data, uint32_t length) {
+    unsigned char header[8];
+    putBigEndian(header, length + (prefix ? 4 : 0));
+    memcpy(header + 4, type, 4);
+    fwrite(header, 1, 8, handle);
+    uint32_t crc = updateCrc(0, header + 4, 4);
+    if (prefix) {
+        fwrite(prefix, 1, 4, handle);
+        crc = updateCrc(crc, prefix, 4);
+    }
+    if (length > 0) fwrite(data, 1, length, handle);
+    crc = updateCrc(crc, data, length);
+    unsigned char footer[4];
+    putBigEndian(footer, crc);
+    fwrite(footer, 1, 4, handle);
+}
+
+/* Writes the png signature and the IHDR chunk of an 8 bit RGBA png */
+void writePngHeader(FILE *handle, uint32_t width, uint32_t height) {
+    static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    unsigned char ihdr[13] = { 0 };
+    putBigEndian(ihdr, width);
+    putBigEndian(ihdr + 4, height);
+    ihdr[8] = 8;
+    ihdr[9] = 6;
+    fwrite(signature, 1, 8, handle);
+    writePngChunk(handle, "IHDR", NULL, ihdr, sizeof(ihdr));
+}
+
+/* The limits of the deflate streams of PngStream */
+enum {
+    /* How far back a match can reach */
+    DeflateWindow = 32768,
+    DeflateMinMatch = 3,
+    DeflateMaxMatch = 258,
+    DeflateHashBits = 15,
+    /* How many earlier positions with the same hash are tried per match */
+    DeflateMaxChain = 32,
+    /* Matches longer than this only put their last position in the hash
+       chains, which keeps long runs cheap */
+    DeflateMaxInsert = 32,
+};
+
+/* A zlib stream that compresses whatever is written into it on the fly,
+   and writes the compressed data as IDAT chunks or into a ByteBuffer. All
+   data goes into a single deflate block with the fixed Huffman codes */
+typedef struct {
+    /* Where the compressed data goes, buffer when it isn't NULL */
+    FILE *handle;
+    ByteBuffer *buffer;
+    /* The compressed bytes that haven't been written yet */
+    unsigned char out[1 << 16];
+    size_t outLength;
+    uint32_t bitBuffer;
+    int bitCount;
+    /* The last DeflateWindow bytes that were compressed, followed by the
+       bytes that still have to be */
+    unsigned char window[2 * DeflateWindow];
+    uint32_t windowLength, encoded;
+    /* The last position of every hash in the window and the position
+       before that with the same hash for every position, or -1 */
+    int32_t head[1 << DeflateHashBits];
+    int32_t previous[2 * DeflateWindow];
+    uint32_t adler;
+} PngStream;
+
+/* Writes the compressed bytes that are waiting */
+static void flushPngStream(PngStream *stream) {
+    if (stream->outLength == 0) return;
+    if (stream->buffer) {
+        appendBytes(stream->buffer, stream->out, stream->outLength);
+    }
+    else {
+        writePngChunk(stream->handle, "IDAT", NULL, stream->out, (uint32_t) stream->outLength);
+    }
+    stream->outLength = 0;
+}
+
+/* Adds count bits to the stream, the lowest bit first */
+static void putStreamBits(PngStream *stream, uint32_t value, int count) {
+    stream->bitBuffer |= value << stream->bitCount;
+    stream->bitCount += count;
+    while (stream->bitCount >= 8) {
+        stream->out[stream->outLength++] = (unsigned char) stream->bitBuffer;
+        stream->bitBuffer >>= 8;
+        stream->bitCount -= 8;
+        if (stream->outLength == sizeof(stream->out)) flushPngStream(stream);
+    }
+}
+
+/* Adds a Huffman code to the stream, those go in with the highest bit first */
+static void putStreamCode(PngStream *stream, uint32_t code, int length) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; ++i) {
+        reversed = reversed << 1 | ((code >> i) & 1);
+    }
+    putStreamBits(stream, reversed, length);
+}
+
+/* Adds a literal or length symbol with its fixed Huffman code */
+static void putStreamSymbol(PngStream *stream, uint32_t symbol) {
+    if (symbol < 144) putStreamCode(stream, 0x30 + symbol, 8);
+    else if (symbol < 256) putStreamCode(stream, 0x190 + symbol - 144, 9);
+    else if (symbol < 280) putStreamCode(stream, symbol - 256, 7);
+    else putStreamCode(stream, 0xC0 + symbol - 280, 8);
+}
+
+/* Adds a match of length bytes that starts distance bytes back */
+static void putStreamMatch(PngStream *stream, uint32_t length, uint32_t distance) {
+    static const uint16_t lengthBase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const uint8_t lengthExtra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    static const uint16_t distanceBase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+    };
+    static const uint8_t distanceExtra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+    int code = 28;
+    while (lengthBase[code] > length) code--;
+    putStreamSymbol(stream, 257 + code);
+    putStreamBits(stream, length - lengthBase[code], lengthExtra[code]);
+    code = 29;
+    while (distanceBase[code] > distance) code--;
+    putStreamCode(stream, code, 5);
+    putStreamBits(stream, distance - distanceBase[code], distanceExtra[code]);
+}
+
+/* The hash chain of the 3 bytes at position of the window */
+static inline uint32_t hashStreamBytes(const unsigned char *bytes) {
+    uint32_t value = (uint32_t) bytes[0] << 16 | (uint32_t) bytes[1] << 8 | bytes[2];
+    return (value * 2654435761u) >> (32 - DeflateHashBits);
+}
+
+/* Puts a position of the window in its hash chain */
+static inline void insertStreamPosition(PngStream *stream, uint32_t position) {
+    uint32_t hash = hashStreamBytes(stream->window + position);
+    stream->previous[position] = stream->head[hash];
+    stream->head[hash] = (int32_t) position;
+}
+
+/* Compresses the window up to end. Matches never reach past the end of the window */
+static void compressStream(PngStream *stream, uint32_t end) {
+    const unsigned char *window = stream->window;
+    uint32_t position = stream->encoded;
+    while (position < end) {
+        uint32_t available = stream->windowLength - position;
+        if (available > DeflateMaxMatch) available = DeflateMaxMatch;
+        uint32_t bestLength = 0, bestDistance = 0;
+        if (available >= DeflateMinMatch) {
+            int32_t candidate = stream->head[hashStreamBytes(window + position)];
+            for (int chain = 0; candidate >= 0 && chain < DeflateMaxChain; ++chain) {
+                uint32_t distance = position - (uint32_t) candidate;
+                if (distance > DeflateWindow) break;
+                uint32_t length = 0;
+                while (length + 8 <= available) {
+                    uint64_t a, b;
+                    memcpy(&a, window + candidate + length, 8);
+                    memcpy(&b, window + position + length, 8);
+                    if (a != b) break;
+                    length += 8;
+                }
+                while (length < available && window[candidate + length] == window[position + length]) length++;
+                if (length > bestLength) {
+                    bestLength = length;
+                    bestDistance = distance;
+                    if (length == available) break;
+                }
+                candidate = stream->previous[candidate];
+            }
+        }
+
+        if (bestLength >= DeflateMinMatch) {
+            putStreamMatch(stream, bestLength, bestDistance);
+            if (bestLength <= DeflateMaxInsert) {
+                for (uint32_t i = 0; i < bestLength; ++i) {
+                    if (position + i + DeflateMinMatch <= stream->windowLength) insertStreamPosition(stream, position + i);
+                }
+            }
+            else if (position + bestLength - 1 + DeflateMinMatch <= stream->windowLength) {
+                insertStreamPosition(stream, position + bestLength - 1);
+            }
+            position += bestLength;
+        }
+        else {
+            putStreamSymbol(stream, window[position]);
+            if (available >= DeflateMinMatch) insertStreamPosition(stream, position);
+            position++;
+        }
+    }
+    stream->encoded = position;
+}
+
+/* Starts a zlib stream that writes IDAT chunks to handle, or appends to
+   buffer when handle is NULL */
+PngStream *beginPngStream(FILE *handle, ByteBuffer *buffer) {
+    PngStream *stream = malloc(sizeof(PngStream));
+    stream->handle = handle;
+    stream->buffer = buffer;
+    stream->outLength = 0;
+    stream->bitBuffer = 0;
+    stream->bitCount = 0;
+    stream->windowLength = 0;
+    stream->encoded = 0;
+    stream->adler = 1;
+    memset(stream->head, 0xFF, sizeof(stream->head));
+    /* The zlib header, then a final block with the fixed Huffman codes */
+    putStreamBits(stream, 0x78, 8);
+    putStreamBits(stream, 0x01, 8);
+    putStreamBits(stream, 1, 1);
+    putStreamBits(stream, 1, 2);
+    return stream;
+}
+
+/* Adds data to a zlib stream */
+void writePngStream(PngStream *stream, const unsigned char *data, size_t length) {
+    stream->adler = updateAdler(stream->adler, data, length);
+    while (length > 0) {
+        if (stream->windowLength == sizeof(stream->window)) {
+            /* Compress everything that can't be part of a longer match
+               anymore, then drop the oldest half of the window */
+            compressStream(stream, stream->windowLength - DeflateMaxMatch);
+            memmove(stream->window, stream->window + DeflateWindow, DeflateWindow);
+            stream->windowLength -= DeflateWindow;
+            stream->encoded -= DeflateWindow;
+            for (uint32_t i = 0; i < (1 << DeflateHashBits); ++i) {
+                stream->head[i] = stream->head[i] >= DeflateWindow ? stream->head[i] - DeflateWindow : -1;
+            }
+            for (uint32_t i = 0; i < DeflateWindow; ++i) {
+                int32_t previous = stream->previous[i + DeflateWindow];
+                stream->previous[i] = previous >= DeflateWindow ? previous - DeflateWindow : -1;
+            }
+        }
+        size_t chunk = sizeof(stream->window) - stream->windowLength;
+        if (chunk > length) chunk = length;
+        memcpy(stream->window + stream->windowLength, data, chunk);
+        stream->windowLength += (uint32_t) chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+/* Compresses what's left of a zlib stream, writes it and frees the stream */
+void endPngStream(PngStream *stream) {
+    compressStream(stream, stream->windowLength);
+    putStreamSymbol(stream, 256);
+    if (stream->bitCount > 0) putStreamBits(stream, 0, 8 - stream->bitCount);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        putStreamBits(stream, (stream->adler >> shift) & 0xFF, 8);
+    }
+    flushPngStream(stream);
+    free(stream);
+}
+
+/* Predicts a byte of a row that's scaled up on the X axis with png filter
+   type. All copies of a pixel but the first have the pixel itself on
+   their left, so first is the prediction of the first copy, and rest the
+   prediction of the others */
+static inline void predictScaledPng(int type, int value, int left, int up, int upLeft, int *first, int *rest) {
+    if (type == 0) {
+        *first = *rest = 0;
+    }
+    else if (type == 1) {
+        *first = left;
+        *rest = value;
+    }
+    else if (type == 2) {
+        *first = *rest = up;
+    }
+    else if (type == 3) {
+        *first = (left + up) >> 1;
+        *rest = (value + up) >> 1;
+    }
+    else {
+        int p = left + up - upLeft;
+        int pa = abs(p - left), pb = abs(p - up), pc = abs(p - upLeft);
+        *first = pa <= pb && pa <= pc ? left : pb <= pc ? up : upLeft;
+        *rest = value;
+    }
+}
+
+/* Filters a row of pixels scaled up scale times on the X axis into out,
+   which starts with the filter type. The filter is the one with the
+   smallest sum of absolute values, the same guess most png encoders make.
+   The guess is made on the row before it's scaled, and the row is only
+   widened while the chosen filter is written */
+static void filterScaledPngRow(const uint32_t *row, const uint32_t *above, uint32_t width, uint32_t scale,
+                               unsigned char *out) {
+    const unsigned char *current = (const unsigned char *) row;
+    const unsigned char *prior = (const unsigned char *) above;
+    size_t length = (size_t) width * 4;
+    int best = 0;
+    uint64_t bestSum = UINT64_MAX;
+    for (int pass = 0; pass < 6; ++pass) {
+        /* The first five passes try every filter, the last one writes the best */
+        int type = pass < 5 ? pass : best;
+        uint64_t firstSum = 0, restSum = 0;
+        for (size_t i = 0; i < length; ++i) {
+            int value = current[i];
+            int left = i >= 4 ? current[i - 4] : 0;
+            int up = above ? prior[i] : 0;
+            int upLeft = above && i >= 4 ? prior[i - 4] : 0;
+            int first, rest;
+            predictScaledPng(type, value, left, up, upLeft, &first, &rest);
+            unsigned char firstByte = (unsigned char) (value - first);
+            unsigned char restByte = (unsigned char) (value - rest);
+            if (pass == 5) {
+                unsigned char *copy = out + 1 + i / 4 * scale * 4 + i % 4;
+                copy[0] = firstByte;
+                for (uint32_t k = 1; k < scale; ++k) copy[k * 4] = restByte;
+            }
+            firstSum += abs((signed char) firstByte);
+            restSum += abs((signed char) restByte);
+        }
+        uint64_t sum = firstSum + restSum * (scale - 1);
+        if (pass < 5 && sum < bestSum) {
+            bestSum = sum;
+            best = type;
+        }
+    }
+    out[0] = (unsigned char) best;
+}
+
+/* Compresses the rectangle rect of an image, scaled up scale times with
+   nearest neighbor sampling, as png image data into stream. The scaled
+   image is never made: every row is widened while it's filtered, and the
+   rows that repeat it are written with the Up filter, so they're all zeroes.
+   above is the row of the png above the rectangle, or NULL when the
+   rectangle starts the png */
+void writeScaledPngData(PngStream *stream, Image img, Rect rect, uint32_t scale, const uint32_t *above) {
+    size_t rowLength = (size_t) rect.width * scale * 4;
+    unsigned char *filtered = malloc(rowLength + 1);
+    unsigned char *repeat = calloc(rowLength + 1, 1);
+    repeat[0] = 2;
+
+    for (uint32_t y = 0; y < rect.height; ++y) {
+        const uint32_t *row = img.rgba + (size_t) (rect.y + y) * img.width + rect.x;
+        filterScaledPngRow(row, y > 0 ? row - img.width : above, rect.width, scale, filtered);
+        writePngStream(stream, filtered, rowLength + 1);
+        for (uint32_t i = 1; i < scale; ++i) {
+            writePngStream(stream, repeat, rowLength + 1);
+        }
+    }
+
+    free(filtered);
+    free(repeat);
+}
+
+/* Writes an image scaled up scale times as a png */
+int writeScaledPng(Image img, uint32_t scale, FILE *handle) {
+    writePngHeader(handle, img.width * scale, img.height * scale);
+    PngStream *stream = beginPngStream(handle, NULL);
+    writeScaledPngData(stream, img, (Rect) { 0, 0, img.width, img.height }, scale, NULL);
+    endPngStream(stream);
+    writePngChunk(handle, "IEND", NULL, NULL, 0);
+    return !ferror(handle);
+}
+
+/* Writes an image scaled up scale times as a QOI file. The pixels are
+   encoded straight into a small buffer that's flushed whenever it fills
+   up, so there is never a copy of the whole encoded image in memory */
+int writeQoi(Image img, uint32_t scale, FILE *handle) {
+    unsigned char buffer[1 << 16];
+    size_t used = 0;
+    unsigned char header[14] = { 'q', 'o', 'i', 'f' };
+    putBigEndian(header + 4, img.width * scale);
+    putBigEndian(header + 8, img.height * scale);
+    header[12] = 4;
+    header[13] = 0;
+    memcpy(buffer, header, sizeof(header));
+    used = sizeof(header);
+
+    uint32_t index[64] = { 0 };
+    uint32_t previous = 0xFF000000;
+    uint32_t run = 0;
+    size_t numPixels = (size_t) img.width * img.height * scale * scale;
+    /* Where the next pixel comes from, and how many times it and its row
+       have been repeated for the scale */
+    const uint32_t *sourceRow = img.rgba;
+    uint32_t column = 0, columnCopy = 0, rowCopy = 0;
+    for (size_t i = 0; i < numPixels; ++i) {
+        /* Every op is at most 5 bytes */
+        if (used > sizeof(buffer) - 5) {
+            if (fwrite(buffer, 1, used, handle) != used) return 0;
+            used = 0;
+        }
+
+        uint32_t pixel = sourceRow[column];
+        if (++columnCopy == scale) {
+            columnCopy = 0;
+            if (++column == img.width) {
+                column = 0;
+                if (++rowCopy == scale) {
+                    rowCopy = 0;
+                    sourceRow += img.width;
+                }
+            }
+        }
+        if (pixel == previous) {
+            run++;
+            if (run == 62 || i + 1 == numPixels) {
+                buffer[used++] = (unsigned char) (0xC0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            buffer[used++] = (unsigned char) (0xC0 | (run - 1));
+            run = 0;
+        }
+
+        const unsigned char *p = (const unsigned char *) &pixel;
+        const unsigned char *q = (const unsigned char *) &previous;
+        uint32_t hash = (p[0] * 3 + p[1] * 5 + p[2] * 7 + p[3] * 11) % 64;
+        if (index[hash] == pixel) {
+            buffer[used++] = (unsigned char) hash;
+        }
+        else if (p[3] == q[3]) {
+            int8_t dr = (int8_t) (p[0] - q[0]);
+            int8_t dg = (int8_t) (p[1] - q[1]);
+            int8_t db = (int8_t) (p[2] - q[2]);
+            int8_t drg = (int8_t) (dr - dg);
+            int8_t dbg = (int8_t) (db - dg);
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                buffer[used++] = (unsigned char) (0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            }
+            else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                buffer[used++] = (unsigned char) (0x80 | (dg + 32));
+                buffer[used++] = (unsigned char) ((drg + 8) << 4 | (dbg + 8));
+            }
+            else {
+                buffer[used++] = 0xFE;
+                buffer[used++] = p[0];
+                buffer[used++] = p[1];
+                buffer[used++] = p[2];
+            }
+        }
+        else {
+            buffer[used++] = 0xFF;
+            buffer[used++] = p[0];
+            buffer[used++] = p[1];
+            buffer[used++] = p[2];
+            buffer[used++] = p[3];
+        }
+        index[hash] = pixel;
+        previous = pixel;
+    }
+
+    static const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    if (used > sizeof(buffer) - sizeof(end)) {
+        if (fwrite(buffer, 1, used, handle) != used) return 0;
+        used = 0;
+    }
+    memcpy(buffer + used, end, sizeof(end));
+    used += sizeof(end);
+    return fwrite(buffer, 1, used, handle) == used;
+}
+
+/* Reads the 4x4 block of pixels at (blockX, blockY) as bytes, repeating
+   the last row and column for blocks that stick out of the image */
+static void readBlock(Image img, uint32_t blockX, uint32_t blockY, unsigned char block[16][4]) {
+    for (uint32_t y = 0; y < 4; ++y) {
+        uint32_t sourceY = blockY * 4 + y < img.height ? blockY * 4 + y : img.height - 1;
+        for (uint32_t x = 0; x < 4; ++x) {
+            uint32_t sourceX = blockX * 4 + x < img.width ? blockX * 4 + x : img.width - 1;
+            memcpy(block[y * 4 + x], &img.rgba[(size_t) sourceY * img.width + sourceX], 4);
+        }
+    }
+}
+
+/* Finds the two pixels at the ends of the principal axis of the colors
+   of the used pixels (channels 0 until numChannels) of a block */
+static void findBlockEndpoints(unsigned char block[16][4], const int *used, int numChannels,
+                               int *first, int *last) {
+    float mean[4] = { 0 }, count = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (!used[i]) continue;
+        for (int c = 0; c < numChannels; ++c) mean[c] += block[i][c];
+        count++;
+    }
+    for (int c = 0; c < numChannels; ++c) mean[c] /= count;
+    float covariance[4][4] = { { 0 } };
+    for (int i = 0; i < 16; ++i) {
+        if (!used[i]) continue;
+        for (int a = 0; a < numChannels; ++a) {
+            for (int b = 0; b < numChannels; ++b) {
+                covariance[a][b] += (block[i][a] - mean[a]) * (block[i][b] - mean[b]);
+            }
+        }
+    }
+    /* A few rounds of power iteration are plenty to find the axis */
+    float axis[4] = { 1, 1, 1, 1 };
+    for (int round = 0; round < 8; ++round) {
+        float next[4] = { 0 }, length = 0;
+        for (int a = 0; a < numChannels; ++a) {
+            for (int b = 0; b < numChannels; ++b) next[a] += covariance[a][b] * axis[b];
+            length += next[a] * next[a];
+        }
+        if (length == 0) break;
+        length = sqrtf(length);
+        for (int a = 0; a < numChannels; ++a) axis[a] = next[a] / length;
+    }
+    float minimum = 1e30f, maximum = -1e30f;
+    *first = *last = -1;
+    for (int i = 0; i < 16; ++i) {
+        if (!used[i]) continue;
+        float projection = 0;
+        for (int c = 0; c < numChannels; ++c) projection += block[i][c] * axis[c];
+        if (projection < minimum) minimum = projection, *first = i;
+        if (projection > maximum) maximum = projection, *last = i;
+    }
+}
+
+/* Packs a color into 5:6:5 bits */
+static uint16_t packColor565(const unsigned char *color) {
+    return (uint16_t) ((color[0] * 31 + 127) / 255 << 11 | (color[1] * 63 + 127) / 255 << 5 | (color[2] * 31 + 127) / 255);
+}
+
+/* Unpacks a 5:6:5 color */
+static void unpackColor565(uint16_t packed, int *color) {
+    color[0] = (packed >> 11 & 31) * 255 / 31;
+    color[1] = (packed >> 5 & 63) * 255 / 63;
+    color[2] = (packed & 31) * 255 / 31;
+}
+
+/* Encodes a block as BC1. Blocks with transparent pixels use the three
+   color mode, where index 3 is transparent black */
+static void encodeBC1(unsigned char block[16][4], unsigned char *out) {
+    int used[16], numUsed = 0, transparent = 0;
+    for (int i = 0; i < 16; ++i) {
+        used[i] = block[i][3] >= 128;
+        numUsed += used[i];
+        transparent |= !used[i];
+    }
+    uint16_t color0 = 0, color1 = 0;
+    uint32_t indices = 0;
+    if (numUsed == 0) {
+        indices = 0xFFFFFFFF;
+    }
+    else {
+        int first, last;
+        findBlockEndpoints(block, used, 3, &first, &last);
+        color0 = packColor565(block[last]);
+        color1 = packColor565(block[first]);
+        /* The order of the endpoints selects the mode */
+        if (transparent ? color0 > color1 : color0 < color1) {
+            uint16_t swap = color0;
+            color0 = color1;
+            color1 = swap;
+        }
+        int palette[4][3];
+        unpackColor565(color0, palette[0]);
+        unpackColor565(color1, palette[1]);
+        int numColors = 4;
+        for (int c = 0; c < 3; ++c) {
+            if (color0 > color1) {
+                palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+            }
+            else {
+                palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+                numColors = 3;
+            }
+        }
+        for (int i = 0; i < 16; ++i) {
+            uint32_t best = 3;
+            if (used[i]) {
+                int bestError = 1 << 30;
+                for (int p = 0; p < numColors; ++p) {
+                    int error = 0;
+                    for (int c = 0; c < 3; ++c) {
+                        int d = block[i][c] - palette[p][c];
+                        error += d * d;
+                    }
+                    if (error < bestError) bestError = error, best = p;
+                }
+            }
+            indices |= best << (i * 2);
+        }
+    }
+    out[0] = (unsigned char) color0;
+    out[1] = (unsigned char) (color0 >> 8);
+    out[2] = (unsigned char) color1;
+    out[3] = (unsigned char) (color1 >> 8);
+    for (int i = 0; i < 4; ++i) out[4 + i] = (unsigned char) (indices >> (i * 8));
+}
+
+/* Appends count bits of value to a 128 bit block */
+static void putBits(unsigned char *out, int *position, uint32_t value, int count) {
+    for (int i = 0; i < count; ++i, ++*position) {
+        if (value >> i & 1) out[*position / 8] |= (unsigned char) (1 << (*position % 8));
+    }
+}
+
+/* Returns the error of a decoded pixel, the color of transparent pixels
+   doesn't matter */
+static int pixelError(const unsigned char *source, const int *decoded) {
+    int error = (source[3] - decoded[3]) * (source[3] - decoded[3]);
+    if (source[3] == 0) return error;
+    for (int c = 0; c < 3; ++c) {
+        error += (source[c] - decoded[c]) * (source[c] - decoded[c]);
+    }
+    return error;
+}
+
+/* Encodes a block as BC7 mode 6: one subset with RGBA endpoints of 7 bits
+   plus a shared low bit per endpoint, and 4 bit indices. Returns the error */
+static int encodeBC7Mode6(unsigned char block[16][4], unsigned char *out) {
+    static const int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+    int used[16];
+    for (int i = 0; i < 16; ++i) used[i] = 1;
+    int first, last;
+    findBlockEndpoints(block, used, 4, &first, &last);
+
+    /* Quantize the endpoints, picking the low bit that fits them best */
+    int endpoints[2][4], pBits[2];
+    const unsigned char *sources[2] = { block[first], block[last] };
+    for (int e = 0; e < 2; ++e) {
+        int bestError = 1 << 30;
+        for (int p = 0; p < 2; ++p) {
+            int error = 0, quantized[4];
+            for (int c = 0; c < 4; ++c) {
+                int value = (sources[e][c] - p + 1) >> 1;
+                if (value > 127) value = 127;
+                if (value < 0) value = 0;
+                quantized[c] = value;
+                int d = sources[e][c] - (value << 1 | p);
+                error += d * d;
+            }
+            if (error < bestError) {
+                bestError = error;
+                pBits[e] = p;
+                memcpy(endpoints[e], quantized, sizeof(quantized));
+            }
+        }
+    }
+
+    int palette[16][4];
+    for (int w = 0; w < 16; ++w) {
+        for (int c = 0; c < 4; ++c) {
+            int a = endpoints[0][c] << 1 | pBits[0], b = endpoints[1][c] << 1 | pBits[1];
+            palette[w][c] = ((64 - weights[w]) * a + weights[w] * b + 32) >> 6;
+        }
+    }
+    int indices[16], totalError = 0;
+    for (int i = 0; i < 16; ++i) {
+        int bestError = 1 << 30;
+        for (int w = 0; w < 16; ++w) {
+            int error = pixelError(block[i], palette[w]);
+            if (error < bestError) bestError = error, indices[i] = w;
+        }
+        totalError += bestError;
+    }
+    /* The high bit of the first index is implied to be 0 */
+    if (indices[0] >= 8) {
+        for (int c = 0; c < 4; ++c) {
+            int swap = endpoints[0][c];
+            endpoints[0][c] = endpoints[1][c];
+            endpoints[1][c] = swap;
+        }
+        int swap = pBits[0];
+        pBits[0] = pBits[1];
+        pBits[1] = swap;
+        for (int i = 0; i < 16; ++i) indices[i] = 15 - indices[i];
+    }
+
+    memset(out, 0, 16);
+    int position = 0;
+    putBits(out, &position, 1 << 6, 7);
+    for (int c = 0; c < 4; ++c) {
+        putBits(out, &position, (uint32_t) endpoints[0][c], 7);
+        putBits(out, &position, (uint32_t) endpoints[1][c], 7);
+    }
+    putBits(out, &position, (uint32_t) pBits[0], 1);
+    putBits(out, &position, (uint32_t) pBits[1], 1);
+    putBits(out, &position, (uint32_t) indices[0], 3);
+    for (int i = 1; i < 16; ++i) {
+        putBits(out, &position, (uint32_t) indices[i], 4);
+    }
+    return totalError;
+}
+
+/* Encodes a block as BC7 mode 5: one subset with 7 bit RGB endpoints and
+   8 bit alpha endpoints that have their own 2 bit indices, so transparent
+   pixels don't pull the colors along. Returns the error */
+static int encodeBC7Mode5(unsigned char block[16][4], unsigned char *out) {
+    static const int weights[4] = { 0, 21, 43, 64 };
+    int used[16], numUsed = 0;
+    int alphaMin = 255, alphaMax = 0;
+    for (int i = 0; i < 16; ++i) {
+        used[i] = block[i][3] > 0;
+        numUsed += used[i];
+        if (block[i][3] < alphaMin) alphaMin = block[i][3];
+        if (block[i][3] > alphaMax) alphaMax = block[i][3];
+    }
+    if (numUsed == 0) {
+        for (int i = 0; i < 16; ++i) used[i] = 1;
+    }
+    int first, last;
+    findBlockEndpoints(block, used, 3, &first, &last);
+
+    int colors[2][3], alphas[2] = { alphaMin, alphaMax };
+    for (int c = 0; c < 3; ++c) {
+        colors[0][c] = block[first][c] >> 1;
+        colors[1][c] = block[last][c] >> 1;
+    }
+    int palette[4][4];
+    for (int w = 0; w < 4; ++w) {
+        for (int c = 0; c < 3; ++c) {
+            int a = colors[0][c] << 1 | colors[0][c] >> 6, b = colors[1][c] << 1 | colors[1][c] >> 6;
+            palette[w][c] = ((64 - weights[w]) * a + weights[w] * b + 32) >> 6;
+        }
+        palette[w][3] = ((64 - weights[w]) * alphas[0] + weights[w] * alphas[1] + 32) >> 6;
+    }
+    int colorIndices[16], alphaIndices[16], totalError = 0;
+    for (int i = 0; i < 16; ++i) {
+        int bestError = 1 << 30;
+        alphaIndices[i] = 0;
+        for (int w = 0; w < 4; ++w) {
+            int d = block[i][3] - palette[w][3];
+            if (d * d < bestError) bestError = d * d, alphaIndices[i] = w;
+        }
+        totalError += bestError;
+        bestError = 1 << 30;
+        colorIndices[i] = 0;
+        if (block[i][3] == 0) {
+            bestError = 0;
+        }
+        for (int w = 0; w < 4 && bestError > 0; ++w) {
+            int error = 0;
+            for (int c = 0; c < 3; ++c) {
+                error += (block[i][c] - palette[w][c]) * (block[i][c] - palette[w][c]);
+            }
+            if (error < bestError) bestError = error, colorIndices[i] = w;
+        }
+        totalError += bestError;
+    }
+    /* The high bits of the first indices are implied to be 0 */
+    if (colorIndices[0] >= 2) {
+        for (int c = 0; c < 3; ++c) {
+            int swap = colors[0][c];
+            colors[0][c] = colors[1][c];
+            colors[1][c] = swap;
+        }
+        for (int i = 0; i < 16; ++i) colorIndices[i] = 3 - colorIndices[i];
+    }
+    if (alphaIndices[0] >= 2) {
+        int swap = alphas[0];
+        alphas[0] = alphas[1];
+        alphas[1] = swap;
+        for (int i = 0; i < 16; ++i) alphaIndices[i] = 3 - alphaIndices[i];
+    }
+
+    memset(out, 0, 16);
+    int position = 0;
+    putBits(out, &position, 1 << 5, 6);
+    putBits(out, &position, 0, 2);
+    for (int c = 0; c < 3; ++c) {
+        putBits(out, &position, (uint32_t) colors[0][c], 7);
+        putBits(out, &position, (uint32_t) colors[1][c], 7);
+    }
+    putBits(out, &position, (uint32_t) alphas[0], 8);
+    putBits(out, &position, (uint32_t) alphas[1], 8);
+    putBits(out, &position, (uint32_t) colorIndices[0], 1);
+    for (int i = 1; i < 16; ++i) putBits(out, &position, (uint32_t) colorIndices[i], 2);
+    putBits(out, &position, (uint32_t) alphaIndices[0], 1);
+    for (int i = 1; i < 16; ++i) putBits(out, &position, (uint32_t) alphaIndices[i], 2);
+    return totalError;
+}
+
+/* Encodes a block as BC7, in whichever of modes 5 and 6 fits it best */
+static void encodeBC7(unsigned char block[16][4], unsigned char *out) {
+    unsigned char mode5[16];
+    int error6 = encodeBC7Mode6(block, out);
+    if (error6 > 0 && encodeBC7Mode5(block, mode5) < error6) {
+        memcpy(out, mode5, 16);
+    }
+}
+
+/* Block compresses an image, the rows of blocks are encoded in parallel.
+   Returns the blocks and stores their size in length */
+unsigned char *compressBlocks(Image img, BlockFormat format, size_t *length) {
+    uint32_t blocksX = (img.width + 3) / 4, blocksY = (img.height + 3) / 4;
+    size_t blockSize = format == BF_BC1 ? 8 : 16;
+    *length = (size_t) blocksX * blocksY * blockSize;
+    unsigned char *blocks = malloc(*length);
+    #pragma omp parallel for schedule(dynamic)
+    for (int by = 0; by < (int) blocksY; ++by) {
+        unsigned char pixels[16][4];
+        for (uint32_t bx = 0; bx < blocksX; ++bx) {
+            unsigned char *out = blocks + ((size_t) by * blocksX + bx) * blockSize;
+            readBlock(img, bx, (uint32_t) by, pixels);
+            if (format == BF_BC1) {
+                encodeBC1(pixels, out);
+            }
+            else {
+                encodeBC7(pixels, out);
+            }
+        }
+    }
+    return blocks;
+}
+
+/* Writes block compressed images as a DDS file, the images after the
+   first one are its mipmaps */
+int writeDds(const Image *levels, uint32_t numLevels, BlockFormat format, FILE *handle) {
+    size_t length;
+    unsigned char *blocks = compressBlocks(levels[0], format, &length);
+
+    uint32_t header[32] = { 0 };
+    header[0] = 0x20534444;           /* "DDS " */
+    header[1] = 124;                  /* Size of the header */
+    header[2] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000; /* Caps, height, width, pixel format, linear size */
+    header[3] = levels[0].height;
+    header[4] = levels[0].width;
+    header[5] = (uint32_t) length;
+    header[19] = 32;                  /* Size of the pixel format */
+    header[20] = 0x4;                 /* The pixel format is a FourCC */
+    header[21] = format == BF_BC1 ? 0x31545844 : 0x30315844; /* "DXT1" or "DX10" */
+    header[27] = 0x1000;              /* A texture */
+    if (numLevels > 1) {
+        header[2] |= 0x20000;         /* Mipmap count */
+        header[7] = numLevels;
+        header[27] |= 0x8 | 0x400000; /* Complex, mipmapped */
+    }
+    int ok = fwrite(header, sizeof(header), 1, handle) == 1;
+    if (format == BF_BC7) {
+        /* DXGI_FORMAT_BC7_UNORM, a 2D texture, one array element */
+        uint32_t dx10[5] = { 98, 3, 0, 1, 0 };
+        ok = ok && fwrite(dx10, sizeof(dx10), 1, handle) == 1;
+    }
+    ok = ok && fwrite(blocks, 1, length, handle) == length;
+    free(blocks);
+    for (uint32_t i = 1; ok && i < numLevels; ++i) {
+        blocks = compressBlocks(levels[i], format, &length);
+        ok = fwrite(blocks, 1, length, handle) == length;
+        free(blocks);
+    }
+    return ok;
+}
+
+/* Writes an image in the output format that was picked on the command line */
+void writeImage(Image img, const char *path, const CLArgs *args) {
+    /* stb_image_write can only write to a file on disk */
+    if (args->format == OF_PNG && args->scale == 1 && strcmp(path, "-") != 0 && !archive && !outputQueue) {
+        if (!stbi_write_png(path, img.width, img.height, 4, img.rgba, img.width * 4)) {
+            fputs("Error: Failed to write png file\n", stderr);
+        }
+        return;
+    }
+
+    FILE *handle = openOutput(path);
+    int ok = handle != NULL;
+    if (ok && args->format == OF_PNG) {
+        ok = writeScaledPng(img, args->scale, handle);
+    }
+    else if (ok && args->format == OF_QOI) {
+        ok = writeQoi(img, args->scale, handle);
+    }
+    else if (ok && args->format == OF_DDS) {
+        ok = writeDds(&img, 1, args->blockFormat, handle);
+    }
+    if (handle) ok = closeOutput(handle, path) && ok;
+    if (!ok) {
+        fprintf(stderr, "Error: Failed to write %s file\n", outputFormatExtensions[args->format] + 1);
+    }
+}
+
+/* Returns the smallest rectangle that contains every pixel that differs
+   between two images of the same size, or an empty rectangle */
+Rect findChangedRect(Image before, Image after) {
+    uint32_t minX = after.width, minY = after.height, maxX = 0, maxY = 0;
+    for (uint32_t y = 0; y < after.height; ++y) {
+        const uint32_t *rowBefore = before.rgba + (size_t) y * after.width;
+        const uint32_t *rowAfter = after.rgba + (size_t) y * after.width;
+        if (memcmp(rowBefore, rowAfter, after.width * sizeof(uint32_t)) == 0) continue;
+        if (y < minY) minY = y;
+        maxY = y;
+        uint32_t x = 0, lastX = after.width - 1;
+        while (rowBefore[x] == rowAfter[x]) x++;
+        while (rowBefore[lastX] == rowAfter[lastX]) lastX--;
+        if (x < minX) minX = x;
+        if (lastX > maxX) maxX = lastX;
+    }
+    if (minY > maxY) return (Rect) { 0, 0, 0, 0 };
+    return (Rect) { minX, minY, maxX - minX + 1, maxY - minY + 1 };
+}
+
+/* Writes the frames as an animated png, scaled up scale times. Every frame
+   after the first only contains the rectangle that changed since the frame
+   before it */
+void writeAnimatedPng(const Image *frames, uint32_t numFrames, uint32_t fps, uint32_t scale, const char *path) {
+    Rect *rects = malloc(sizeof(Rect) * numFrames);
+    ByteBuffer *encoded = calloc(numFrames, sizeof(ByteBuffer));
+
+    /* Compress the changed part of every frame on its own */
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) numFrames; ++i) {
+        Image frame = frames[i];
+        Rect rect = { 0, 0, frame.width, frame.height };
+        if (i > 0) {
+            rect = findChangedRect(frames[i - 1], frame);
+            /* Frames need at least one pixel, so repeat an unchanged one */
+            if (rect.width == 0) rect = (Rect) { 0, 0, 1, 1 };
+        }
+        rects[i] = rect;
+        PngStream *stream = beginPngStream(NULL, &encoded[i]);
+        writeScaledPngData(stream, frame, rect, scale, NULL);
+        endPngStream(stream);
+    }
+
+    FILE *handle = openOutput(path);
+    if (!handle) {
+        fputs("Error: Failed to write png file\n", stderr);
+    }
+    else {
+        writePngHeader(handle, frames[0].width * scale, frames[0].height * scale);
+        unsigned char actl[8];
+        putBigEndian(actl, numFrames);
+        putBigEndian(actl + 4, 0);
+        writePngChunk(handle, "acTL", NULL, actl, sizeof(actl));
+
+        uint32_t sequence = 0;
+        for (uint32_t i = 0; i < numFrames; ++i) {
+            /* The frame replaces its rectangle, transparent pixels included,
+               and stays on the canvas for the next frame */
+            unsigned char fctl[26];
+            putBigEndian(fctl, sequence++);
+            putBigEndian(fctl + 4, rects[i].width * scale);
+            putBigEndian(fctl + 8, rects[i].height * scale);
+            putBigEndian(fctl + 12, rects[i].x * scale);
+            putBigEndian(fctl + 16, rects[i].y * scale);
+            fctl[20] = 0;
+            fctl[21] = 1;
+            fctl[22] = (unsigned char) (fps >> 8);
+            fctl[23] = (unsigned char) fps;
+            fctl[24] = 0; /* APNG_DISPOSE_OP_NONE */
+            fctl[25] = 0; /* APNG_BLEND_OP_SOURCE */
+            writePngChunk(handle, "fcTL", NULL, fctl, sizeof(fctl));
+
+            /* The first frame is the default image, the others go in fdAT chunks */
+            if (i == 0) {
+                writePngChunk(handle, "IDAT", NULL, encoded[i].data, (uint32_t) encoded[i].length);
+            }
+            else {
+                unsigned char sequenceNumber[4];
+                putBigEndian(sequenceNumber, sequence++);
+                writePngChunk(handle, "fdAT", sequenceNumber, encoded[i].data, (uint32_t) encoded[i].length);
+            }
+        }
+        writePngChunk(handle, "IEND", NULL, NULL, 0);
+        if (!closeOutput(handle, path)) {
+            fputs("Error: Failed to write png file\n", stderr);
+        }
+    }
+
+    for (uint32_t i = 0; i < numFrames; ++i) {
+        free(encoded[i].data);
+    }
+    free(encoded);
+    free(rects);
+}
+
+/* Writes a PM_ANIMATED sheet as a png without ever holding the whole
+   sheet: every keyframe's band is rasterized, filtered and compressed on
+   its own, while the band of the next keyframe is rasterized. Memory
+   grows with the biggest keyframe instead of with the animation. The
+   layout is made as well when layout isn't NULL */
+void writeStreamedAnimatedSheet(ParsedVox vox, uint32_t scale, const char *path, SheetLayout *layout) {
+    uint64_t width = 0, height = 0, bandHeight = 0;
+    uint32_t *firstCell = malloc(sizeof(uint32_t) * vox.numModels);
+    uint32_t numCells = 0;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        const SizeChunk *size = vox.sizeChunks[i];
+        if ((uint64_t) size->x * size->z > width) width = (uint64_t) size->x * size->z;
+        if (size->y > bandHeight) bandHeight = size->y;
+        height += size->y;
+        firstCell[i] = numCells;
+        numCells += size->z;
+    }
+    if (layout) *layout = makeSheetLayout(vox, PM_ANIMATED);
+    /* The largest size a png can have */
+    if (width * scale > INT32_MAX || height * scale > INT32_MAX) {
+        fputs("Error: The sheet is too big for a png\n", stderr);
+        exit(-1);
+    }
+    uint32_t colors[256];
+    makeColorTable(vox.palette, colors);
+
+    FILE *handle = openOutput(path);
+    if (!handle) {
+        fputs("Error: Failed to write png file\n", stderr);
+        free(firstCell);
+        return;
+    }
+    writePngHeader(handle, (uint32_t) (width * scale), (uint32_t) (height * scale));
+    PngStream *stream = beginPngStream(handle, NULL);
+
+    size_t bandPixels = (size_t) width * bandHeight;
+    uint32_t *bands[2] = { malloc(sizeof(uint32_t) * bandPixels), malloc(sizeof(uint32_t) * bandPixels) };
+    uint32_t *lastRow = malloc(sizeof(uint32_t) * width);
+    int hasLastRow = 0;
+    /* Keyframe i is rasterized while keyframe i - 1 is compressed */
+    for (uint32_t i = 0; i <= vox.numModels; ++i) {
+        #pragma omp parallel sections
+        {
+            #pragma omp section
+            if (i > 0) {
+                const SizeChunk *size = vox.sizeChunks[i - 1];
+                Image band = { (uint32_t) width, size->y, bands[(i - 1) % 2] };
+                writeScaledPngData(stream, band, (Rect) { 0, 0, band.width, band.height }, scale,
+                                   hasLastRow ? lastRow : NULL);
+            }
+            #pragma omp section
+            if (i < vox.numModels) {
+                const SizeChunk *size = vox.sizeChunks[i];
+                uint32_t *band = bands[i % 2];
+                memset(band, 0, sizeof(uint32_t) * width * size->y);
+                SortedVoxels sorted = sortVoxels(size, vox.voxelChunks[i]);
+                rasterizeHorizontal(&sorted, size, colors, band, width, layout ? layout->cells + firstCell[i] : NULL);
+                freeSortedVoxels(sorted);
+            }
+        }
+        /* The filter of the first row of a band looks at the last row of the band above,
+           keyframes without rows leave the one before that above */
+        if (i > 0 && vox.sizeChunks[i - 1]->y > 0) {
+            const SizeChunk *size = vox.sizeChunks[i - 1];
+            hasLastRow = 1;
+            memcpy(lastRow, bands[(i - 1) % 2] + (size_t) (size->y - 1) * width, sizeof(uint32_t) * width);
+        }
+    }
+    endPngStream(stream);
+    writePngChunk(handle, "IEND", NULL, NULL, 0);
+    if (!closeOutput(handle, path)) {
+        fputs("Error: Failed to write png file\n", stderr);
+    }
+
+    free(lastRow);
+    free(bands[0]);
+    free(bands[1]);
+    free(firstCell);
+}
+
+/* Makes the name of a file that is written next to the output, by
+   replacing the extension of the output file with suffix */
+void makeSidecarPath(char *buffer, size_t size, const char *outFile, const char *suffix) {
+    const char *dot = strrchr(outFile, '.');
+    const char *slash = strrchr(outFile, '/');
+    int nameLength = (int) strlen(outFile);
+    if (dot && (!slash || dot > slash)) nameLength = (int) (dot - outFile);
+    snprintf(buffer, size - 1, "%.*s%s", nameLength, outFile, suffix);
+}
+
+/* The version of the --layout file, which changes when its layout does */
+const uint32_t LayoutVersion = 1;
+const uint32_t LayoutMagic   = 1280324182;  /* V 2 P L */
+
+/* The amount of 32 bit values in the header of a --layout file: the magic,
+   the version, the PackingMode, the width and height of the sheet, the
+   number of cells, the size of a cell so newer fields can be skipped, and
+   a reserved 0. And the amount in a cell, which are the fields of SheetCell */
+enum {
+    LayoutHeaderValues = 8,
+    LayoutCellValues = 11,
+};
+
+/* Writes where every cell of a sheet is and which part of it is drawn
+   to OUTPUT.layout.bin, and with --layout-json to OUTPUT.layout.json too.
+   Everything is scaled like the sheet */
+void writeSheetLayout(SheetLayout layout, const CLArgs *args) {
+    uint32_t scale = args->scale;
+    SheetCell *cells = malloc(sizeof(SheetCell) * (layout.numCells ? layout.numCells : 1));
+    uint32_t numEmpty = 0;
+    for (uint32_t i = 0; i < layout.numCells; ++i) {
+        SheetCell cell = layout.cells[i];
+        cells[i] = (SheetCell) {
+            cell.x * scale, cell.y * scale, cell.width * scale, cell.height * scale, cell.layer, cell.frame, {
+                cell.bounds.x * scale, cell.bounds.y * scale, cell.bounds.width * scale, cell.bounds.height * scale,
+                cell.bounds.numVoxels
+            }
+        };
+        if (cell.bounds.numVoxels == 0) numEmpty++;
+    }
+
+    char path[128];
+    makeSidecarPath(path, sizeof(path), args->outFile, ".layout.bin");
+    /* The file is little endian, whatever the machine is */
+    size_t fileSize = 4 * (LayoutHeaderValues + (size_t) LayoutCellValues * layout.numCells);
+    unsigned char *data = malloc(fileSize);
+    uint32_t header[LayoutHeaderValues] = {
+        LayoutMagic, LayoutVersion, args->mode, layout.width * scale, layout.height * scale,
+        layout.numCells, 4 * LayoutCellValues, 0
+    };
+    for (int i = 0; i < LayoutHeaderValues; ++i) {
+        putLittleEndian(data + 4 * i, header[i]);
+    }
+    for (uint32_t i = 0; i < layout.numCells; ++i) {
+        const SheetCell *cell = &cells[i];
+        uint32_t values[LayoutCellValues] = {
+            cell->x, cell->y, cell->width, cell->height, cell->layer, cell->frame,
+            cell->bounds.x, cell->bounds.y, cell->bounds.width, cell->bounds.height, cell->bounds.numVoxels
+        };
+        unsigned char *out = data + 4 * (LayoutHeaderValues + (size_t) LayoutCellValues * i);
+        for (int j = 0; j < LayoutCellValues; ++j) {
+            putLittleEndian(out + 4 * j, values[j]);
+        }
+    }
+    FILE *handle = openOutput(path);
+    int ok = handle != NULL;
+    ok = ok && fwrite(data, 1, fileSize, handle) == fileSize;
+    if (handle) ok = closeOutput(handle, path) && ok;
+    free(data);
+    if (!ok) {
+        fputs("Error: Failed to write layout file\n", stderr);
+    }
+
+    if (args->layoutJson) {
+        makeSidecarPath(path, sizeof(path), args->outFile, ".layout.json");
+        handle = openOutput(path);
+        if (!handle) {
+            fputs("Error: Failed to write layout file\n", stderr);
+        }
+        else {
+            fprintf(handle, "{\n  \"mode\": \"%s\",\n  \"width\": %u,\n  \"height\": %u,\n  \"cells\": [",
+                    packingModeStrings[args->mode], layout.width * scale, layout.height * scale);
+            for (uint32_t i = 0; i < layout.numCells; ++i) {
+                const SheetCell *cell = &cells[i];
+                fprintf(handle, "%s\n    { \"x\": %u, \"y\": %u, \"width\": %u, \"height\": %u, \"layer\": %u, "
+                        "\"frame\": %u, \"box\": [%u, %u, %u, %u], \"voxels\": %u }", i ? "," : "",
+                        cell->x, cell->y, cell->width, cell->height, cell->layer, cell->frame,
+                        cell->bounds.x, cell->bounds.y, cell->bounds.width, cell->bounds.height,
+                        cell->bounds.numVoxels);
+            }
+            fputs("\n  ]\n}\n", handle);
+            closeOutput(handle, path);
+        }
+    }
+    printInfo("Wrote the layout of %u cells, %u of them empty\n", layout.numCells, numEmpty);
+    free(cells);
+}
+
+/* Halves an image of cells, every 2x2 block of pixels becomes one pixel.
+   A side of the cells that is already 1 pixel isn't halved. The colors
+   are weighted by their alpha, so transparent pixels don't darken the
+   edges of the voxels */
+Image downsampleCells(Image img, uint32_t cellWidth, uint32_t cellHeight) {
+    uint32_t factorX = cellWidth > 1 ? 2 : 1, factorY = cellHeight > 1 ? 2 : 1;
+    uint32_t width = img.width / factorX, height = img.height / factorY;
+    uint32_t *rgba = malloc((size_t) width * height * sizeof(uint32_t));
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < (int) height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            uint32_t alpha = 0, color[3] = { 0 };
+            for (uint32_t j = 0; j < factorY; ++j) {
+                const unsigned char *source = (const unsigned char *)
+                    (img.rgba + (size_t) (y * factorY + j) * img.width + x * factorX);
+                for (uint32_t i = 0; i < factorX * 4; i += 4) {
+                    uint32_t a = source[i + 3];
+                    color[0] += source[i] * a;
+                    color[1] += source[i + 1] * a;
+                    color[2] += source[i + 2] * a;
+                    alpha += a;
+                }
+            }
+            unsigned char *out = (unsigned char *) (rgba + (size_t) y * width + x);
+            for (int c = 0; c < 3; ++c) {
+                out[c] = alpha ? (unsigned char) ((color[c] + alpha / 2) / alpha) : 0;
+            }
+            uint32_t count = factorX * factorY;
+            out[3] = (unsigned char) ((alpha + count / 2) / count);
+        }
+    }
+    return (Image) {
+        width, height,
+        rgba
+    };
+}
+
+/* Makes the mipmaps of an image of power of two sized cells, down to the
+   level where the cells are 1 pixel wide or high. The first level is img
+   itself. Returns the levels and stores how many there are in numLevels */
+Image *makeMipmaps(Image img, uint32_t cellWidth, uint32_t cellHeight, uint32_t *numLevels) {
+    uint32_t smallest = cellWidth < cellHeight ? cellWidth : cellHeight;
+    *numLevels = 1;
+    while ((1u << *numLevels) <= smallest) ++*numLevels;
+    Image *levels = malloc(sizeof(Image) * *numLevels);
+    levels[0] = img;
+    for (uint32_t i = 1; i < *numLevels; ++i) {
+        levels[i] = downsampleCells(levels[i - 1], cellWidth >> (i - 1), cellHeight >> (i - 1));
+    }
+    return levels;
+}
+
+/* Writes an image of cells of the given size, with its mipmaps when those
+   were asked for. The mipmaps go into the same file for DDS, and into
+   files of their own with _mipN added to the name otherwise */
+void writeMipmappedImage(Image img, uint32_t cellWidth, uint32_t cellHeight, const char *path, const CLArgs *args) {
+    if (!args->mipmaps) {
+        writeImage(img, path, args);
+        return;
+    }
+    if (cellWidth == 0 || (cellWidth & (cellWidth - 1)) || (cellHeight & (cellHeight - 1))) {
+        fputs("Error: --mipmaps needs cells of the same power of two size\n", stderr);
+        exit(-1);
+    }
+
+    uint32_t numLevels;
+    Image *levels = makeMipmaps(img, cellWidth, cellHeight, &numLevels);
+    if (args->format == OF_DDS) {
+        FILE *handle = openOutput(path);
+        int ok = handle && writeDds(levels, numLevels, args->blockFormat, handle);
+        if (handle) ok = closeOutput(handle, path) && ok;
+        if (!ok) {
+            fputs("Error: Failed to write dds file\n", stderr);
+        }
+    }
+    else {
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < (int) numLevels; ++i) {
+            char name[128];
+            if (i == 0) {
+                snprintf(name, sizeof(name) - 1, "%s", path);
+            }
+            else {
+                char suffix[32];
+                snprintf(suffix, sizeof(suffix), "_mip%d%s", i, outputFormatExtensions[args->format]);
+                makeSidecarPath(name, sizeof(name), path, suffix);
+            }
+            writeImage(levels[i], name, args);
+        }
+    }
+    for (uint32_t i = 1; i < numLevels; ++i) {
+        freeImage(levels[i]);
+    }
+    free(levels);
+}
+
+/* The positions at which a sheet may be cut into pages without cutting
+   through a cell, from 0 up to and including the size of the sheet */
+typedef struct {
+    uint32_t *x, *y;
+    uint32_t numX, numY;
+    /* The size of the cells when they're all the same, otherwise 0 */
+    uint32_t cellWidth, cellHeight;
+} SheetCuts;
+
+/* Frees the positions of a SheetCuts */
+void freeSheetCuts(SheetCuts cuts) {
+    free(cuts.x);
+    free(cuts.y);
+}
+
+/* Returns every multiple of step up to length, and length itself */
+static uint32_t *makeStepCuts(uint32_t step, uint32_t length, uint32_t *numCuts) {
+    uint32_t *cuts = malloc(sizeof(uint32_t) * (length / step + 2));
+    *numCuts = 0;
+    for (uint32_t position = 0; position < length; position += step) {
+        cuts[(*numCuts)++] = position;
+    }
+    cuts[(*numCuts)++] = length;
+    return cuts;
+}
+
+/* Returns the cuts of a sheet that consists of a grid of equally sized cells */
+SheetCuts makeGridCuts(Image img, uint32_t cellWidth, uint32_t cellHeight) {
+    SheetCuts cuts;
+    cuts.x = makeStepCuts(cellWidth, img.width, &cuts.numX);
+    cuts.y = makeStepCuts(cellHeight, img.height, &cuts.numY);
+    cuts.cellWidth = cellWidth;
+    cuts.cellHeight = cellHeight;
+    return cuts;
+}
+
+/* Returns the cuts of a PM_ANIMATED sheet. Rows may be cut between the
+   keyframes, and columns where there is a cell border in every keyframe */
+SheetCuts makeAnimatedCuts(ParsedVox vox, Image img) {
+    /* Cell borders line up at the least common multiple of the widths */
+    uint64_t step = 1;
+    for (uint32_t i = 0; i < vox.numModels && step <= img.width; ++i) {
+        uint64_t a = step, b = vox.sizeChunks[i]->x;
+        while (b) {
+            uint64_t t = a % b;
+            a = b;
+            b = t;
+        }
+        step = step / a * vox.sizeChunks[i]->x;
+    }
+    SheetCuts cuts;
+    cuts.x = makeStepCuts(step > img.width ? img.width : (uint32_t) step, img.width, &cuts.numX);
+    cuts.y = malloc(sizeof(uint32_t) * (vox.numModels + 1));
+    cuts.numY = 0;
+    uint32_t y = 0;
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        cuts.y[cuts.numY++] = y;
+        y += vox.sizeChunks[i]->y;
+    }
+    cuts.y[cuts.numY++] = y;
+    /* The cells are only the same when all keyframes are the same size */
+    cuts.cellWidth = vox.sizeChunks[0]->x;
+    cuts.cellHeight = vox.sizeChunks[0]->y;
+    for (uint32_t i = 1; i < vox.numModels; ++i) {
+        if (vox.sizeChunks[i]->x != cuts.cellWidth || vox.sizeChunks[i]->y != cuts.cellHeight) {
+            cuts.cellWidth = cuts.cellHeight = 0;
+        }
+    }
+    return cuts;
+}
+
+/* Picks the cuts that split an axis into as few segments of at most
+   maxSize pixels as possible. Returns the number of segments, or 0 when
+   there's a cell that's bigger than maxSize */
+static uint32_t splitAxis(const uint32_t *cuts, uint32_t numCuts, uint32_t maxSize, uint32_t *segments) {
+    uint32_t numSegments = 0;
+    uint32_t current = 0;
+    segments[0] = cuts[0];
+    while (current + 1 < numCuts) {
+        uint32_t next = current;
+        while (next + 1 < numCuts && cuts[next + 1] - cuts[current] <= maxSize) next++;
+        if (next == current) return 0;
+        segments[++numSegments] = cuts[next];
+        current = next;
+    }
+    return numSegments;
+}
+
+/* Writes a sheet, split into pages when it is bigger than --max-texture-size.
+   The pages are encoded in parallel and listed in OUTPUT.pages.txt */
+void writeSheet(Image img, SheetCuts cuts, const char *path, const CLArgs *args) {
+    if (args->maxTextureSize == 0) {
+        writeMipmappedImage(img, cuts.cellWidth, cuts.cellHeight, path, args);
+        return;
+    }
+
+    /* The pages are split before they're scaled up */
+    uint32_t maxSize = args->maxTextureSize / args->scale;
+    if (args->powerOfTwo && maxSize > 0) maxSize = previousPowerOfTwo(maxSize);
+    uint32_t *xSegments = malloc(sizeof(uint32_t) * cuts.numX);
+    uint32_t *ySegments = malloc(sizeof(uint32_t) * cuts.numY);
+    uint32_t columns = splitAxis(cuts.x, cuts.numX, maxSize, xSegments);
+    uint32_t rows = splitAxis(cuts.y, cuts.numY, maxSize, ySegments);
+    if (columns == 0 || rows == 0) {
+        fprintf(stderr, "Error: The cells are bigger than the maximum texture size of %u\n", maxSize * args->scale);
+        exit(-1);
+    }
+
+    uint32_t numPages = columns * rows;
+    Rect *pages = malloc(sizeof(Rect) * numPages);
+    char (*names)[128] = malloc(sizeof(*names) * numPages);
+    for (uint32_t row = 0; row < rows; ++row) {
+        for (uint32_t column = 0; column < columns; ++column) {
+            uint32_t i = row * columns + column;
+            pages[i] = (Rect) {
+                xSegments[column], ySegments[row],
+                xSegments[column + 1] - xSegments[column],
+                ySegments[row + 1] - ySegments[row]
+            };
+            if (numPages == 1) {
+                snprintf(names[i], sizeof(names[i]) - 1, "%s", path);
+            }
+            else if (args->mode == PM_GAMEMAKER) {
+                /* Keep _stripN at the end so GameMaker can still import every page */
+                snprintf(names[i], sizeof(names[i]) - 1, "%s_%u_strip%02u%s", args->outFile, i,
+                         pages[i].width / (cuts.x[1] - cuts.x[0]), outputFormatExtensions[args->format]);
+            }
+            else {
+                char suffix[32];
+                snprintf(suffix, sizeof(suffix), "_%u%s", i, outputFormatExtensions[args->format]);
+                makeSidecarPath(names[i], sizeof(names[i]), path, suffix);
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) numPages; ++i) {
+        Rect page = pages[i];
+        uint32_t width = args->powerOfTwo ? nextPowerOfTwo(page.width) : page.width;
+        uint32_t height = args->powerOfTwo ? nextPowerOfTwo(page.height) : page.height;
+        uint32_t *rgba = calloc((size_t) width * height, sizeof(uint32_t));
+        for (uint32_t y = 0; y < page.height; ++y) {
+            memcpy(rgba + (size_t) y * width, img.rgba + (size_t) (page.y + y) * img.width + page.x,
+                   page.width * sizeof(uint32_t));
+        }
+        Image pageImage = { width, height, rgba };
+        writeMipmappedImage(pageImage, cuts.cellWidth, cuts.cellHeight, names[i], args);
+        freeImage(pageImage);
+    }
+
+    char indexPath[128];
+    makeSidecarPath(indexPath, sizeof(indexPath), args->outFile, ".pages.txt");
+    FILE *handle = openOutput(indexPath);
+    if (!handle) {
+        fputs("Error: Failed to write page file\n", stderr);
+    }
+    else {
+        fprintf(handle, "sheet %u %u\n", img.width, img.height);
+        fprintf(handle, "pages %u\n", numPages);
+        for (uint32_t i = 0; i < numPages; ++i) {
+            fprintf(handle, "%u %u %u %u %u %s\n", i, pages[i].x, pages[i].y,
+                    pages[i].width, pages[i].height, names[i]);
+        }
+        closeOutput(handle, indexPath);
+    }
+    if (numPages > 1) printInfo("Split the sheet into %u pages\n", numPages);
+
+    free(names);
+    free(pages);
+    free(xSegments);
+    free(ySegments);
+}
+
+/* Writes where the trimmed layers are in the original models */
+void writeTrimInfo(const TrimInfo *info, const char *path) {
+    FILE *handle = openOutput(path);
+    if (!handle) {
+        fputs("Error: Failed to write trim file\n", stderr);
+        return;
+    }
+    fprintf(handle, "offset %u %u %u\n", info->x, info->y, info->z);
+    fprintf(handle, "layers %u\n", info->numLayers);
+    for (uint32_t i = 0; i < info->numLayers; ++i) {
+        fprintf(handle, "%u %u\n", i, info->layerZ[i]);
+    }
+    closeOutput(handle, path);
+}
+
+/* Writes which cell every layer of every keyframe uses */
+void writeFrameTable(const FrameTable *table, const char *path) {
+    FILE *handle = openOutput(path);
+    if (!handle) {
+        fputs("Error: Failed to write frame file\n", stderr);
+        return;
+    }
+    fprintf(handle, "frames %u\n", table->numFrames);
+    fprintf(handle, "layers %u\n", table->numLayers);
+    fprintf(handle, "cells %u\n", table->numCells);
+    fprintf(handle, "cellsize %u %u\n", table->cellWidth, table->cellHeight);
+    fprintf(handle, "columns %u\n", table->columns);
+    for (uint32_t f = 0; f < table->numFrames; ++f) {
+        for (uint32_t z = 0; z < table->numLayers; ++z) {
+            fprintf(handle, z == 0 ? "%u" : " %u", table->cells[f * table->numLayers + z]);
+        }
+        fputc('\n', handle);
+    }
+    closeOutput(handle, path);
+}
+
+/* A layer of a model of an input file in the atlas */
+typedef struct {
+    uint32_t file, model, z;
+    /* The page the layer is on, and where it is on that page */
+    uint32_t page;
+    PackedLayer rect;
+} AtlasEntry;
+
+/* Sorts atlas entries from the tallest to the shortest layer */
+static int compareEntryHeight(const void *a, const void *b) {
+    const AtlasEntry *entryA = *(const AtlasEntry * const *) a;
+    const AtlasEntry *entryB = *(const AtlasEntry * const *) b;
+    if (entryA->rect.height != entryB->rect.height) return entryA->rect.height < entryB->rect.height ? 1 : -1;
+    if (entryA->rect.width != entryB->rect.width) return entryA->rect.width < entryB->rect.width ? 1 : -1;
+    return entryA < entryB ? -1 : 1;
+}
+
+/* An input file of the atlas */
+typedef struct {
+    char *buffer;
+    size_t length;
+    ParsedVox vox;
+    /* The non-empty layers of all models in the file */
+    AtlasEntry *entries;
+    uint32_t numEntries;
+} AtlasInput;
+
+/* Packs the layers of all models of all input files into atlas pages,
+   and writes the pages and a file that tells where every layer went */
+void makeAtlas(const CLArgs *args) {
+    uint32_t numFiles = (uint32_t) args->numInFiles;
+    uint32_t pageSize = args->atlasSize;
+    AtlasInput *inputs = calloc(numFiles, sizeof(AtlasInput));
+
+    /* Read the input files and find the rectangles of their layers */
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) numFiles; ++i) {
+        AtlasInput *input = &inputs[i];
+        readVox(args->inFiles[i], &input->length, &input->buffer);
+        input->vox = parseVox(input->length, input->buffer);
+        if (args->flatten) {
+            ParsedVox flat = flattenScene(input->length, input->buffer, input->vox);
+            if (flat.ownedChunks != input->vox.ownedChunks) {
+                freeParsedVox(input->vox);
+                input->vox = flat;
+            }
+        }
+
+        uint32_t maxEntries = 0;
+        for (uint32_t m = 0; m < input->vox.numModels; ++m) {
+            maxEntries += input->vox.sizeChunks[m]->z;
+        }
+        input->entries = malloc(sizeof(AtlasEntry) * maxEntries);
+        PackedLayer layers[256];
+        for (uint32_t m = 0; m < input->vox.numModels; ++m) {
+            const SizeChunk *size = input->vox.sizeChunks[m];
+            findLayerRects(size, input->vox.voxelChunks[m], layers);
+            for (uint32_t z = 0; z < size->z; ++z) {
+                if (layers[z].width == 0) continue;
+                input->entries[input->numEntries++] = (AtlasEntry) {
+                    (uint32_t) i, m, z, 0, layers[z]
+                };
+            }
+        }
+    }
+
+    /* Pack the layers from tallest to shortest into the first page they fit on */
+    uint32_t numEntries = 0;
+    for (uint32_t i = 0; i < numFiles; ++i) {
+        numEntries += inputs[i].numEntries;
+    }
+    AtlasEntry **sorted = malloc(sizeof(AtlasEntry *) * numEntries);
+    numEntries = 0;
+    for (uint32_t i = 0; i < numFiles; ++i) {
+        for (uint32_t j = 0; j < inputs[i].numEntries; ++j) {
+            sorted[numEntries++] = &inputs[i].entries[j];
+        }
+    }
+    qsort(sorted, numEntries, sizeof(AtlasEntry *), compareEntryHeight);
+
+    Skyline *pages = NULL;
+    uint32_t numPages = 0;
+    for (uint32_t i = 0; i < numEntries; ++i) {
+        AtlasEntry *entry = sorted[i];
+        if (entry->rect.width > pageSize || entry->rect.height > pageSize) {
+            fprintf(stderr, "Error: A layer of %s doesn't fit on a %u pixel atlas page\n",
+                    args->inFiles[entry->file], pageSize);
+            exit(-1);
+        }
+        uint32_t page = 0;
+        while (page < numPages &&
+                !skylinePack(&pages[page], entry->rect.width, entry->rect.height, &entry->rect.x, &entry->rect.y)) {
+            page++;
+        }
+        if (page == numPages) {
+            pages = realloc(pages, sizeof(Skyline) * ++numPages);
+            pages[page] = makeSkyline(pageSize, pageSize);
+            skylinePack(&pages[page], entry->rect.width, entry->rect.height, &entry->rect.x, &entry->rect.y);
+        }
+        entry->page = page;
+    }
+    free(sorted);
+    printInfo("Packed %u layers into %u atlas pages\n", numEntries, numPages);
+
+    /* Rasterize the layers into their pages, the files all write to
+       different rectangles so they can do so at the same time */
+    Image *images = malloc(sizeof(Image) * numPages);
+    for (uint32_t i = 0; i < numPages; ++i) {
+        images[i] = (Image) {
+            pageSize, pageSize,
+            calloc((size_t) pageSize * pageSize, sizeof(uint32_t))
+        };
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) numFiles; ++i) {
+        AtlasInput *input = &inputs[i];
+        uint32_t colors[256];
+        makeColorTable(input->vox.palette, colors);
+        uint32_t j = 0;
+        for (uint32_t m = 0; m < input->vox.numModels; ++m) {
+            const SizeChunk *size = input->vox.sizeChunks[m];
+            SortedVoxels sortedVoxels = sortVoxels(size, input->vox.voxelChunks[m]);
+            for (; j < input->numEntries && input->entries[j].model == m; ++j) {
+                const AtlasEntry *entry = &input->entries[j];
+                const PackedLayer *rect = &entry->rect;
+                rasterizeLayerRect(&sortedVoxels, size->y, entry->z, rect->offsetX, rect->offsetY,
+                                   rect->offsetY + rect->height, colors,
+                                   images[entry->page].rgba + (size_t) rect->y * pageSize + rect->x, pageSize);
+            }
+            freeSortedVoxels(sortedVoxels);
+        }
+    }
+
+    /* Write the pages, numbered when there are more than one */
+    char (*pageNames)[128] = malloc(sizeof(*pageNames) * numPages);
+    for (uint32_t i = 0; i < numPages; ++i) {
+        if (numPages == 1) {
+            snprintf(pageNames[i], sizeof(pageNames[i]) - 1, "%s", args->outFile);
+        }
+        else {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "_%u%s", i, outputFormatExtensions[args->format]);
+            makeSidecarPath(pageNames[i], sizeof(pageNames[i]), args->outFile, suffix);
+        }
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) numPages; ++i) {
+        writeImage(images[i], pageNames[i], args);
+    }
+
+    /* Write where every layer ended up */
+    char atlasPath[128];
+    makeSidecarPath(atlasPath, sizeof(atlasPath), args->outFile, ".atlas.txt");
+    FILE *handle = openOutput(atlasPath);
+    if (!handle) {
+        fputs("Error: Failed to write atlas file\n", stderr);
+    }
+    else {
+        fprintf(handle, "pages %u\n", numPages);
+        for (uint32_t i = 0; i < numPages; ++i) {
+            fprintf(handle, "page %u %u %u %s\n", i, pageSize, pageSize, pageNames[i]);
+        }
+        fprintf(handle, "files %u\n", numFiles);
+        for (uint32_t i = 0; i < numFiles; ++i) {
+            fprintf(handle, "file %u %s\n", i, args->inFiles[i]);
+        }
+        fprintf(handle, "layers %u\n", numEntries);
+        for (uint32_t i = 0; i < numFiles; ++i) {
+            for (uint32_t j = 0; j < inputs[i].numEntries; ++j) {
+                const AtlasEntry *entry = &inputs[i].entries[j];
+                const PackedLayer *rect = &entry->rect;
+                fprintf(handle, "%u %u %u %u %u %u %u %u %u %u\n", entry->file, entry->model, entry->z,
+                        entry->page, rect->x, rect->y, rect->width, rect->height, rect->offsetX, rect->offsetY);
+            }
+        }
+        closeOutput(handle, atlasPath);
+    }
+
+    for (uint32_t i = 0; i < numPages; ++i) {
+        freeSkyline(pages[i]);
+        freeImage(images[i]);
+    }
+    for (uint32_t i = 0; i < numFiles; ++i) {
+        free(inputs[i].entries);
+        freeParsedVox(inputs[i].vox);
+        free(inputs[i].buffer);
+    }
+    free(pageNames);
+    free(pages);
+    free(images);
+    free(inputs);
+}
+
+/* Lays the layers of a PM_VERTICAL sheet out like mode does, by copying
+   them row by row */
+Image composeSheet(Image layers, const SizeChunk *size, PackingMode mode) {
+    uint32_t columns = size->z, rows = 1;
+    if (mode == PM_SQUARE) {
+        columns = rows = (uint32_t) ceil(sqrt(size->z));
+    }
+    Image sheet = { size->x * columns, size->y * rows, NULL };
+    sheet.rgba = calloc((size_t) sheet.width * sheet.height, sizeof(uint32_t));
+    for (uint32_t z = 0; z < size->z; ++z) {
+        uint32_t *cell = sheet.rgba + (size_t) (z / columns) * size->y * sheet.width + z % columns * size->x;
+        const uint32_t *layer = layers.rgba + (size_t) z * size->y * size->x;
+        for (uint32_t y = 0; y < size->y; ++y) {
+            memcpy(cell + (size_t) y * sheet.width, layer + (size_t) y * size->x, size->x * sizeof(uint32_t));
+        }
+    }
+    return sheet;
+}
+
+/* An image that writeModeSheets writes */
+typedef struct {
+    Image img;
+    char name[160];
+    /* The arguments for the mode the image is in, with the output file
+       set to the name of the image */
+    CLArgs args;
+    /* Whether this is a sheet, or a single layer of multifile */
+    int isSheet;
+} ModeOutput;
+
+/* Writes every mode of args->modes. The layers are rasterized once, the
+   sheets of the modes are composed from them, and everything is encoded
+   at the same time. layerSeparator goes between the name and the layer
+   number of multifile */
+void writeModeSheets(ParsedVox vox, const CLArgs *args, const char *layerSeparator) {
+    const SizeChunk *size = vox.sizeChunks[0];
+    const char *extension = outputFormatExtensions[args->format];
+    char base[128];
+    makeSidecarPath(base, sizeof(base), args->outFile, "");
+
+    /* The layers under each other, which is also the vertical sheet */
+    Image layers = makeSheet(vox, PM_VERTICAL, NULL);
+    Image sheets[PM_SIZE] = { { 0, 0, NULL } };
+    int modes[] = { PM_HORIZONTAL, PM_SQUARE };
+    #pragma omp parallel for
+    for (int i = 0; i < 2; ++i) {
+        if (args->modes & (1u << modes[i] | (modes[i] == PM_HORIZONTAL ? 1u << PM_GAMEMAKER : 0))) {
+            sheets[modes[i]] = composeSheet(layers, size, modes[i]);
+        }
+    }
+    sheets[PM_VERTICAL] = layers;
+    sheets[PM_GAMEMAKER] = sheets[PM_HORIZONTAL];
+
+    uint32_t numOutputs = 0;
+    ModeOutput *outputs = malloc(sizeof(ModeOutput) * (PM_SIZE + size->z));
+    for (int mode = PM_HORIZONTAL; mode <= PM_GAMEMAKER; ++mode) {
+        if (!(args->modes & (1u << mode))) continue;
+        uint32_t count = mode == PM_MULTIFILE ? size->z : 1;
+        for (uint32_t i = 0; i < count; ++i) {
+            ModeOutput *output = &outputs[numOutputs++];
+            output->args = *args;
+            output->args.mode = mode;
+            output->args.outFile = output->name;
+            output->isSheet = mode != PM_MULTIFILE;
+            output->img = sheets[mode];
+            if (mode == PM_MULTIFILE) {
+                output->img = (Image) { size->x, size->y, layers.rgba + (size_t) i * size->x * size->y };
+                snprintf(output->name, sizeof(output->name) - 1, "%s%s%03u%s", base, layerSeparator, i, extension);
+            }
+            else if (mode == PM_GAMEMAKER) {
+                /* writeSheet names the pages after the output file without _stripN */
+                snprintf(output->name, sizeof(output->name) - 1, "%s", base);
+            }
+            else {
+                snprintf(output->name, sizeof(output->name) - 1, "%s_%s%s", base, packingModeStrings[mode], extension);
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) numOutputs; ++i) {
+        ModeOutput *output = &outputs[i];
+        if (!output->isSheet) {
+            writeMipmappedImage(output->img, size->x, size->y, output->name, &output->args);
+            continue;
+        }
+        char path[160];
+        if (output->args.mode == PM_GAMEMAKER) {
+            snprintf(path, sizeof(path) - 1, "%s_strip%02u%s", base, size->z, extension);
+        }
+        else {
+            snprintf(path, sizeof(path) - 1, "%s", output->name);
+        }
+        SheetCuts cuts = makeGridCuts(output->img, size->x, size->y);
+        writeSheet(output->img, cuts, path, &output->args);
+        freeSheetCuts(cuts);
+    }
+
+    free(outputs);
+    freeImage(sheets[PM_HORIZONTAL]);
+    freeImage(sheets[PM_SQUARE]);
+    freeImage(layers);
+}
+
+/* Writes the sheets of a model in horizontal, vertical, square, multifile
+   or gamemaker mode, with --modes or --axes when they're given. Trimming
+   and padding are done here, so every model keeps its own size.
+   layerSeparator goes between the name and the layer number of multifile */
+void writeModel(ParsedVox vox, const CLArgs *args, const char *trimPath, const char *layerSeparator) {
+    ParsedVox model = vox;
+    if (args->trim) {
+        TrimInfo trimInfo;
+        ParsedVox trimmed = trimVox(model, &trimInfo);
+        if (trimmed.ownedChunks != model.ownedChunks) {
+            model = trimmed;
+            printInfo("Trimmed %s to %ix%ix%i\n", args->outFile, model.sizeChunks[0]->x, model.sizeChunks[0]->y,
+                   model.sizeChunks[0]->z);
+        }
+        writeTrimInfo(&trimInfo, trimPath);
+    }
+    if (args->mipmaps || args->format == OF_DDS) {
+        /* Keep the 4x4 blocks or the pixels of the mipmaps from straddling two cells */
+        ParsedVox padded = padVox(model, args->mipmaps ? 0 : 4);
+        if (model.ownedChunks) freeParsedVox(model);
+        model = padded;
+    }
+
+    if (args->modes) {
+        writeModeSheets(model, args, layerSeparator);
+    }
+    else if (args->axes) {
+        SliceSheets slices = makeSliceSheets(model, args->mode, args->axes,
+                                              args->mipmaps ? 0 : args->format == OF_DDS ? 4 : 1);
+        /* Every sheet gets its own name, and its own page file when it's split */
+        char names[AX_SIZE][128];
+        CLArgs axisArgs[AX_SIZE];
+        for (int axis = 0; axis < AX_SIZE; ++axis) {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "_%s%s", sliceAxisNames[axis], outputFormatExtensions[args->format]);
+            makeSidecarPath(names[axis], sizeof(names[axis]), args->outFile, suffix);
+            axisArgs[axis] = *args;
+            axisArgs[axis].outFile = names[axis];
+        }
+        #pragma omp parallel for schedule(dynamic)
+        for (int axis = 0; axis < AX_SIZE; ++axis) {
+            if (!(args->axes & (1u << axis))) continue;
+            Image sheet = slices.sheets[axis];
+            SheetCuts cuts = makeGridCuts(sheet, slices.cellWidth[axis], slices.cellHeight[axis]);
+            writeSheet(sheet, cuts, names[axis], &axisArgs[axis]);
+            freeSheetCuts(cuts);
+        }
+        for (int axis = 0; axis < AX_SIZE; ++axis) {
+            freeImage(slices.sheets[axis]);
+        }
+    }
+    else {
+        SheetLayout layout;
+        Image img = makeSheet(model, args->mode, args->layout ? &layout : NULL);
+        if (args->layout) {
+            writeSheetLayout(layout, args);
+            freeSheetLayout(layout);
+        }
+        char nameBuffer[160];
+        const SizeChunk *size = model.sizeChunks[0];
+
+        if (args->mode == PM_MULTIFILE) {
+            #pragma omp parallel for schedule(dynamic)
+            for (int i = 0; i < (int) size->z; ++i) {
+                char layerName[160];
+                snprintf(layerName, sizeof(layerName) - 1, "%s%s%03i%s", args->outFile, layerSeparator, i,
+                         outputFormatExtensions[args->format]);
+                Image layer = { size->x, size->y, img.rgba + (size_t) size->x * size->y * i };
+                writeMipmappedImage(layer, size->x, size->y, layerName, args);
+            }
+        }
+        else if (args->mode == PM_GAMEMAKER) {
+            snprintf(nameBuffer, sizeof(nameBuffer) - 1, "%s_strip%02i%s", args->outFile, size->z,
+                     outputFormatExtensions[args->format]);
+            SheetCuts cuts = makeGridCuts(img, size->x, size->y);
+            writeSheet(img, cuts, nameBuffer, args);
+            freeSheetCuts(cuts);
+        }
+        else {
+            SheetCuts cuts = makeGridCuts(img, size->x, size->y);
+            writeSheet(img, cuts, args->outFile, args);
+            freeSheetCuts(cuts);
+        }
+        freeImage(img);
+    }
+
+    if (model.ownedChunks) freeParsedVox(model);
+}
+
+/* Writes every model of vox with writeModel, all at the same time. When
+   there is more than one model their number is added to the file names,
+   output.png becomes output_00.png, output_01.png and so on, and output
+   in multifile mode becomes output_00_000.png */
+void writeModels(ParsedVox vox, const CLArgs *args) {
+    char (*names)[128] = malloc(sizeof(*names) * vox.numModels);
+    char (*trimPaths)[128] = malloc(sizeof(*trimPaths) * vox.numModels);
+    CLArgs *modelArgs = malloc(sizeof(CLArgs) * vox.numModels);
+    for (uint32_t i = 0; i < vox.numModels; ++i) {
+        modelArgs[i] = *args;
+        if (vox.numModels == 1) {
+            makeSidecarPath(trimPaths[i], sizeof(trimPaths[i]), args->outFile, ".trim.txt");
+            continue;
+        }
+        /* The number goes before the extension, multifile and gamemaker add their own */
+        char base[128], suffix[32];
+        const char *extension = "";
+        if (args->mode == PM_MULTIFILE || args->mode == PM_GAMEMAKER) {
+            snprintf(base, sizeof(base) - 1, "%s", args->outFile);
+        }
+        else {
+            makeSidecarPath(base, sizeof(base), args->outFile, "");
+            extension = args->outFile + strlen(base);
+        }
+        snprintf(names[i], sizeof(names[i]) - 1, "%s_%02u%s", base, i, extension);
+        snprintf(suffix, sizeof(suffix), "_%02u.trim.txt", i);
+        makeSidecarPath(trimPaths[i], sizeof(trimPaths[i]), args->outFile, suffix);
+        modelArgs[i].outFile = names[i];
+    }
+    if (vox.numModels > 1) {
+        if (strcmp(args->outFile, "-") == 0) {
+            fputs("Error: The file has more than one model, which can't all be written to -\n", stderr);
+            exit(-1);
+        }
+        printInfo("Writing %u models\n", vox.numModels);
+    }
+
+    /* With a single model the parallel loops inside writeModel get all cores */
+    #pragma omp parallel for schedule(dynamic) if (vox.numModels > 1)
+    for (int i = 0; i < (int) vox.numModels; ++i) {
+        writeModel(selectModel(vox, i), &modelArgs[i], trimPaths[i], vox.numModels > 1 ? "_" : "");
+    }
+
+    free(modelArgs);
+    free(trimPaths);
+    free(names);
+}
+
+/* The version of the --shm segment, which changes when its layout does */
+const uint32_t ShmVersion  = 2;
+const uint32_t ShmMagic    = 1397764694;  /* V 2 P S */
+
+/* The header at the start of a --shm segment. It's followed by numCells
+   SheetCells and then by the sheet as RGBA bytes, row by row.
+   generation is odd while vox2png writes the segment, and goes up by 2
+   for every sheet. A reader waits until it's even, copies what it needs
+   and tries again when generation changed in the meantime. The segment
+   only grows, so a reader that mapped less than size has to map it again */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t generation;
+    /* The PackingMode of the sheet */
+    uint32_t mode;
+    uint32_t width, height;
+    uint32_t numCells;
+    /* The size of a SheetCell, so newer fields can be skipped */
+    uint32_t cellSize;
+    /* Where the cells and the pixels start, from the start of the segment */
+    uint32_t cellsOffset, pixelsOffset;
+    /* The size of the segment */
+    uint64_t size;
+    uint32_t reserved[4];
+} ShmHeader;
+
+/* Writes a sheet and its layout into the POSIX shared memory segment name,
+   where another program can pick it up without encoding or decoding it */
+void publishSheet(Image img, SheetLayout layout, PackingMode mode, const char *name) {
+#ifdef _WIN32
+    fputs("Error: --shm isn't supported on Windows\n", stderr);
+    exit(-1);
+#else
+    uint32_t cellsOffset = sizeof(ShmHeader);
+    uint32_t pixelsOffset = cellsOffset + sizeof(SheetCell) * layout.numCells;
+    uint64_t size = pixelsOffset + (uint64_t) img.width * img.height * sizeof(uint32_t);
+    /* Segment names start with a slash */
+    char segment[128];
+    snprintf(segment, sizeof(segment), "%s%s", name[0] == '/' ? "" : "/", name);
+    int fd = shm_open(segment, O_RDWR | O_CREAT, 0644);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0 ||
+            ((uint64_t) status.st_size < size && ftruncate(fd, (off_t) size) != 0)) {
+        fprintf(stderr, "Error: Failed to open shared memory segment %s\n", segment);
+        exit(-1);
+    }
+    if ((uint64_t) status.st_size > size) size = (uint64_t) status.st_size;
+    char *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to map shared memory segment %s\n", segment);
+        exit(-1);
+    }
+
+    /* Mark the segment as being written before anything else changes */
+    ShmHeader *header = (ShmHeader *) data;
+    uint32_t generation = header->magic == ShmMagic ? header->generation & ~1u : 0;
+    __atomic_store_n(&header->generation, generation + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->magic = ShmMagic;
+    header->version = ShmVersion;
+    header->mode = mode;
+    header->width = img.width;
+    header->height = img.height;
+    header->numCells = layout.numCells;
+    header->cellSize = sizeof(SheetCell);
+    header->cellsOffset = cellsOffset;
+    header->pixelsOffset = pixelsOffset;
+    header->size = size;
+    memset(header->reserved, 0, sizeof(header->reserved));
+    memcpy(data + cellsOffset, layout.cells, sizeof(SheetCell) * layout.numCells);
+    memcpy(data + pixelsOffset, img.rgba, (size_t) img.width * img.height * sizeof(uint32_t));
+    __atomic_store_n(&header->generation, generation + 2, __ATOMIC_RELEASE);
+
+    munmap(data, size);
+    printInfo("Published a %ux%u sheet to %s, generation %u\n", img.width, img.height, segment, generation + 2);
+#endif
+}
+
+/* Makes the sheet of vox and publishes it to the segment --shm names */
+void publishVox(ParsedVox vox, const CLArgs *args) {
+    Image img;
+    SheetLayout layout;
+    if (args->mode == PM_ANIMATED) {
+        img = makeAnimatedSheet(vox, &layout);
+    }
+    else if (args->mode == PM_ROTATED) {
+        uint32_t cellWidth, cellHeight;
+        img = makeRotatedSheet(vox, args->angles, args->squash, 1, &cellWidth, &cellHeight, &layout);
+    }
+    else if (args->mode == PM_PACKED) {
+        PackedLayer layers[256];
+        img = makePackedSheet(vox, layers, &layout);
+    }
+    else {
+        if (vox.numModels > 1) {
+            fprintf(stderr, "Error: --shm publishes a single sheet, but this file has %u models\n", vox.numModels);
+            exit(-1);
+        }
+        img = makeSheet(vox, args->mode, &layout);
+    }
+    publishSheet(img, layout, args->mode, args->outFile);
+    freeSheetLayout(layout);
+    freeImage(img);
+}
+
+/* Converts a .vox file that was read into voxBuffer as args says */
+void convertVox(const CLArgs *args, size_t voxLength, const char *voxBuffer) {
+    ParsedVox parsed = parseVox(voxLength, voxBuffer);
+    if (args->flatten) {
+        ParsedVox flat = flattenScene(voxLength, voxBuffer, parsed);
+        if (flat.ownedChunks != parsed.ownedChunks) {
+            freeParsedVox(parsed);
+            parsed = flat;
+        }
+    }
+
+    if (args->cullRadius) {
+        /* Cull before trimming, which moves layers that had empty ones between them together */
+        uint64_t numVoxels = 0, numCulled;
+        for (uint32_t i = 0; i < parsed.numModels; ++i) {
+            numVoxels += parsed.voxelChunks[i]->numVoxels;
+        }
+        ParsedVox culled = cullVox(parsed, args->cullRadius, &numCulled);
+        freeParsedVox(parsed);
+        parsed = culled;
+        printInfo("Culled %llu of %llu voxels (%.1f%%)\n", (unsigned long long) numCulled,
+               (unsigned long long) numVoxels, numVoxels ? 100.0 * numCulled / numVoxels : 0.0);
+    }
+    if (args->shm) {
+        publishVox(parsed, args);
+        freeParsedVox(parsed);
+        return;
+    }
+    /* These modes slice every model on its own, the others need all of them at once */
+    if (!args->bundle && (args->mode == PM_HORIZONTAL || args->mode == PM_VERTICAL || args->mode == PM_SQUARE ||
+                         args->mode == PM_MULTIFILE || args->mode == PM_GAMEMAKER)) {
+        writeModels(parsed, args);
+        freeParsedVox(parsed);
+        return;
+    }
+    if (args->trim) {
+        TrimInfo trimInfo;
+        ParsedVox trimmed = trimVox(parsed, &trimInfo);
+        if (trimmed.ownedChunks != parsed.ownedChunks) {
+            freeParsedVox(parsed);
+            parsed = trimmed;
+            printInfo("Trimmed to %ix%ix%i\n", parsed.sizeChunks[0]->x, parsed.sizeChunks[0]->y, parsed.sizeChunks[0]->z);
+        }
+        char trimPath[128];
+        makeSidecarPath(trimPath, sizeof(trimPath), args->outFile, ".trim.txt");
+        writeTrimInfo(&trimInfo, trimPath);
+    }
+    if (args->bundle) {
+        writeBundle(parsed, args->outFile);
+        freeParsedVox(parsed);
+        return;
+    }
+    if (args->mipmaps || args->format == OF_DDS) {
+        /* Keep the 4x4 blocks or the pixels of the mipmaps from straddling two cells */
+        ParsedVox padded = padVox(parsed, args->mipmaps ? 0 : 4);
+        freeParsedVox(parsed);
+        parsed = padded;
+    }
+
+    Image img = { 0, 0, NULL };
+    SheetLayout layout = { NULL, 0, 0, 0 };
+
+    if (args->mode == PM_ANIMATED && args->apng) {
+        Image *frames = makeAnimationFrames(parsed);
+        writeAnimatedPng(frames, parsed.numModels, args->fps, args->scale, args->outFile);
+        for (uint32_t i = 1; i < parsed.numModels; ++i) {
+            freeImage(frames[i]);
+        }
+        img = frames[0];
+        free(frames);
+    }
+    else if (args->mode == PM_ANIMATED && args->dedup) {
+        FrameTable table;
+        img = makeDedupedAnimatedSheet(parsed, &table);
+        SheetCuts cuts = makeGridCuts(img, table.cellWidth, table.cellHeight);
+        writeSheet(img, cuts, args->outFile, args);
+        freeSheetCuts(cuts);
+        char framesPath[128];
+        makeSidecarPath(framesPath, sizeof(framesPath), args->outFile, ".frames.txt");
+        writeFrameTable(&table, framesPath);
+        freeFrameTable(table);
+    }
+    else if (args->mode == PM_ANIMATED && args->format == OF_PNG && !args->mipmaps && !args->maxTextureSize) {
+        /* Nothing needs the whole sheet, so it can be written as it's made */
+        writeStreamedAnimatedSheet(parsed, args->scale, args->outFile, args->layout ? &layout : NULL);
+    }
+    else if (args->mode == PM_ANIMATED) {
+        img = makeAnimatedSheet(parsed, args->layout ? &layout : NULL);
+        SheetCuts cuts = makeAnimatedCuts(parsed, img);
+        writeSheet(img, cuts, args->outFile, args);
+        freeSheetCuts(cuts);
+    }
+    else if (args->mode == PM_ROTATED) {
+        uint32_t cellWidth, cellHeight;
+        img = makeRotatedSheet(parsed, args->angles, args->squash, args->mipmaps ? 0 : args->format == OF_DDS ? 4 : 1,
+                               &cellWidth, &cellHeight, args->layout ? &layout : NULL);
+        printInfo("Rendered %u angles into %ux%u cells\n", args->angles, cellWidth, cellHeight);
+        SheetCuts cuts = makeGridCuts(img, cellWidth, cellHeight);
+        writeSheet(img, cuts, args->outFile, args);
+        freeSheetCuts(cuts);
+    }
+    else if (args->mode == PM_PACKED) {
+        PackedLayer layers[256];
+        img = makePackedSheet(parsed, layers, args->layout ? &layout : NULL);
+        writeImage(img, args->outFile, args);
+        char layersPath[128];
+        makeSidecarPath(layersPath, sizeof(layersPath), args->outFile, ".layers.txt");
+        writePackedLayers(layers, parsed.sizeChunks[0]->z, layersPath);
+    }
+    if (args->layout) {
+        writeSheetLayout(layout, args);
+        freeSheetLayout(layout);
+    }
+
+    freeImage(img);
+    freeParsedVox(parsed);
+}
+
+/* Returns a time in seconds to measure how long something took */
+double getSeconds(void) {
+#ifdef _WIN32
+    return (double) clock() / CLOCKS_PER_SEC;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+/* Converts every input file into a file of the same name in the directory
+   outFile. The next files are read while one is converted, and the written
+   files are handed to the outputQueue instead of waiting for them */
+void convertBatch(const CLArgs *args) {
+    const char *outDir = args->outFile;
+    const char *extension = args->bundle ? ".vsb" : outputFormatExtensions[args->format];
+    if ((args->mode == PM_MULTIFILE || args->mode == PM_GAMEMAKER) && !args->modes) {
+        extension = "";
+    }
+#ifndef _WIN32
+    mkdir(outDir, 0755);
+    if (args->cold) {
+        /* Without root the page cache can't be dropped as a whole, but the inputs can be */
+        for (int i = 0; i < args->numInFiles; ++i) {
+            int fd = open(args->inFiles[i], O_RDONLY);
+            if (fd < 0) continue;
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+#endif
+
+    double start = getSeconds();
+    IoQueue *queue = beginIo(args->io);
+#ifndef _WIN32
+    /* Files in memory are needed to hand them over, which Windows can't do */
+    outputQueue = queue;
+#endif
+    IoRequest **reads = calloc(args->numInFiles, sizeof(IoRequest *));
+    uint64_t numBytes = 0;
+    for (int i = 0; i < args->numInFiles; ++i) {
+        /* Keep a few reads going ahead of the conversion */
+        for (int j = i; j < args->numInFiles && j < i + IoReadAhead; ++j) {
+            if (!reads[j]) reads[j] = submitRead(queue, args->inFiles[j]);
+        }
+        waitIo(queue, reads[i]);
+        if (reads[i]->failed) {
+            fprintf(stderr, "Error: Failed to read %s\n", args->inFiles[i]);
+            exit(-1);
+        }
+
+        /* The output is named after the input, without its directory and .vox */
+        const char *name = args->inFiles[i];
+        for (const char *c = name; *c; ++c) {
+            if (*c == '/' || *c == '\\') name = c + 1;
+        }
+        int nameLength = (int) strlen(name);
+        if (nameLength > 4 && strcmp(name + nameLength - 4, ".vox") == 0) nameLength -= 4;
+        char outFile[128];
+        int outLength = snprintf(outFile, sizeof(outFile), "%s/%.*s%s", outDir, nameLength, name, extension);
+        if (outLength < 0 || outLength >= (int) sizeof(outFile)) {
+            fprintf(stderr, "Error: The output path for %s is too long\n", args->inFiles[i]);
+            exit(-1);
+        }
+
+        printInfo("Converting %s\n", args->inFiles[i]);
+        CLArgs fileArgs = *args;
+        fileArgs.inFile = args->inFiles[i];
+        fileArgs.outFile = outFile;
+        convertVox(&fileArgs, reads[i]->size, reads[i]->data);
+        numBytes += reads[i]->size;
+        freeIoRequest(reads[i]);
+    }
+    outputQueue = NULL;
+    IoBackend backend = queue->backend;
+    endIo(queue);
+    free(reads);
+
+    double seconds = getSeconds() - start;
+    printInfo("Converted %d files (%.1f MB) in %.3f s, %.1f files/s with %s I/O\n", args->numInFiles,
+              numBytes / 1e6, seconds, seconds > 0 ? args->numInFiles / seconds : 0.0, ioBackendNames[backend]);
+}
+
+int main(int argc, char **argv) {
+    CLArgs args = parseArgs(argc, argv);
+    if (strcmp(args.outFile, "-") == 0 || (args.tarFile && strcmp(args.tarFile, "-") == 0)) {
+        /* Keep the progress messages out of the image */
+        infoOutput = stderr;
+    }
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    makeCrcTable();
+    if (args.tarFile) {
+        beginArchive(args.tarFile);
+    }
+    if (args.mode == PM_ATLAS) {
+        makeAtlas(&args);
+    }
+    else if (args.batch) {
+        convertBatch(&args);
+    }
+    else {
+        char *voxBuffer;
+        size_t voxLength;
+        readVox(args.inFile, &voxLength, &voxBuffer);
+        convertVox(&args, voxLength, voxBuffer);
+        free(voxBuffer);
+    }
+
+    if (archive) endArchive();
+    printInfo("Done\n");
+    free(args.inFiles);
+    return 0;
+}